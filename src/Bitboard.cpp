@@ -0,0 +1,253 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <cassert>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "Bitboard.h"
+#include "Zobrist.h"
+
+static_assert(BOARD_SIZE == 8, "the bitboard needs an 8x8 board");
+
+namespace {
+// Masks of the squares a shift can land on without wrapping a row
+constexpr uint64 NOT_A_FILE = 0xfefefefefefefefeULL;
+constexpr uint64 NOT_H_FILE = 0x7f7f7f7f7f7f7f7fULL;
+constexpr uint64 ALL_FILES = ~uint64{0};
+
+// The 8 directions as shifts, positive to the left
+constexpr int SHIFTS[8] = {1, 8, 7, 9, -1, -8, -7, -9};
+constexpr uint64 MASKS[8] = {
+    NOT_A_FILE, ALL_FILES, NOT_H_FILE, NOT_A_FILE,
+    NOT_H_FILE, ALL_FILES, NOT_A_FILE, NOT_H_FILE
+};
+
+inline uint64 shift(uint64 b, int s) {
+    return s > 0 ? b << s : b >> -s;
+}
+
+// gen grown along direction s through the squares of pro, which has
+// the wrapping file masked out, in 3 steps instead of 6
+inline uint64 fill(uint64 gen, uint64 pro, int s) {
+    gen |= pro & shift(gen, s);
+    pro &= shift(pro, s);
+    gen |= pro & shift(gen, 2 * s);
+    pro &= shift(pro, 2 * s);
+    gen |= pro & shift(gen, 4 * s);
+    return gen;
+}
+
+#ifdef __AVX2__
+// Lane i holds direction i of SHIFTS, the right shifts reuse the
+// amounts of the left ones
+inline __m256i left_shifts() {
+    return _mm256_set_epi64x(9, 7, 8, 1);
+}
+inline __m256i left_masks() {
+    return _mm256_set_epi64x(NOT_A_FILE, NOT_H_FILE, ALL_FILES, NOT_A_FILE);
+}
+inline __m256i right_masks() {
+    return _mm256_set_epi64x(NOT_H_FILE, NOT_A_FILE, ALL_FILES, NOT_H_FILE);
+}
+
+inline __m256i fill_left(__m256i gen, __m256i pro, __m256i s) {
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_sllv_epi64(gen, s)));
+    pro = _mm256_and_si256(pro, _mm256_sllv_epi64(pro, s));
+    s = _mm256_add_epi64(s, s);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_sllv_epi64(gen, s)));
+    pro = _mm256_and_si256(pro, _mm256_sllv_epi64(pro, s));
+    s = _mm256_add_epi64(s, s);
+    return _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_sllv_epi64(gen, s)));
+}
+
+inline __m256i fill_right(__m256i gen, __m256i pro, __m256i s) {
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_srlv_epi64(gen, s)));
+    pro = _mm256_and_si256(pro, _mm256_srlv_epi64(pro, s));
+    s = _mm256_add_epi64(s, s);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_srlv_epi64(gen, s)));
+    pro = _mm256_and_si256(pro, _mm256_srlv_epi64(pro, s));
+    s = _mm256_add_epi64(s, s);
+    return _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_srlv_epi64(gen, s)));
+}
+
+inline uint64 or_lanes(__m256i v) {
+    auto x = _mm_or_si128(_mm256_castsi256_si128(v),
+                          _mm256_extracti128_si256(v, 1));
+    x = _mm_or_si128(x, _mm_unpackhi_epi64(x, x));
+    return uint64(_mm_cvtsi128_si64(x));
+}
+#endif
+}
+
+uint64 Bitboard::legal_moves(uint64 own, uint64 opp) {
+    const auto empty = ~(own | opp);
+#ifdef __AVX2__
+    const auto s = left_shifts();
+    const auto lmask = left_masks();
+    const auto rmask = right_masks();
+    const auto own4 = _mm256_set1_epi64x(own);
+    const auto opp4 = _mm256_set1_epi64x(opp);
+    // Runs of opp discs that start next to an own disc, the square
+    // after the run is a move if it is empty
+    auto left = fill_left(own4, _mm256_and_si256(opp4, lmask), s);
+    auto right = fill_right(own4, _mm256_and_si256(opp4, rmask), s);
+    left = _mm256_and_si256(
+        _mm256_sllv_epi64(_mm256_andnot_si256(own4, left), s), lmask);
+    right = _mm256_and_si256(
+        _mm256_srlv_epi64(_mm256_andnot_si256(own4, right), s), rmask);
+    return or_lanes(_mm256_or_si256(left, right)) & empty;
+#else
+    auto moves = uint64{0};
+    for (int d = 0; d < 8; d++) {
+        // Runs of opp discs that start next to an own disc, the square
+        // after the run is a move if it is empty
+        const auto run = fill(own, opp & MASKS[d], SHIFTS[d]) & ~own;
+        moves |= shift(run, SHIFTS[d]) & MASKS[d];
+    }
+    return moves & empty;
+#endif
+}
+
+uint64 Bitboard::flips(uint64 own, uint64 opp, int square) {
+    assert(square >= 0 && square < BOARD_SQUARE_SIZE);
+    const auto move = uint64{1} << square;
+#ifdef __AVX2__
+    const auto s = left_shifts();
+    const auto lmask = left_masks();
+    const auto rmask = right_masks();
+    const auto zero = _mm256_setzero_si256();
+    const auto own4 = _mm256_set1_epi64x(own);
+    const auto move4 = _mm256_set1_epi64x(move);
+    const auto opp4 = _mm256_set1_epi64x(opp);
+    // The run of opp discs from the move is flipped when an own disc
+    // closes it
+    auto left = fill_left(move4, _mm256_and_si256(opp4, lmask), s);
+    auto right = fill_right(move4, _mm256_and_si256(opp4, rmask), s);
+    const auto left_open = _mm256_cmpeq_epi64(zero, _mm256_and_si256(
+        _mm256_and_si256(_mm256_sllv_epi64(left, s), lmask), own4));
+    const auto right_open = _mm256_cmpeq_epi64(zero, _mm256_and_si256(
+        _mm256_and_si256(_mm256_srlv_epi64(right, s), rmask), own4));
+    left = _mm256_andnot_si256(left_open, left);
+    right = _mm256_andnot_si256(right_open, right);
+    return or_lanes(_mm256_or_si256(left, right)) & ~move;
+#else
+    auto flipped = uint64{0};
+    for (int d = 0; d < 8; d++) {
+        // The run of opp discs from the move is flipped when an own
+        // disc closes it
+        const auto run = fill(move, opp & MASKS[d], SHIFTS[d]);
+        if (shift(run, SHIFTS[d]) & MASKS[d] & own) {
+            flipped |= run;
+        }
+    }
+    return flipped & ~move;
+#endif
+}
+
+int Bitboard::pop_square(uint64& mask) {
+    assert(mask != 0);
+#if defined(_MSC_VER)
+    unsigned long square;
+    _BitScanForward64(&square, mask);
+#else
+    const auto square = __builtin_ctzll(mask);
+#endif
+    mask &= mask - 1;
+    return int(square);
+}
+
+uint64 Bitboard::hash_discs(int color, uint64 discs) {
+    // One lookup per row, so a whole flip costs the same as one disc
+    const auto& keys = Zobrist::zobrist_discs[color];
+    auto res = uint64{0};
+    for (int row = 0; row < BOARD_SIZE; row++) {
+        res ^= keys[row][(discs >> (row * BOARD_SIZE)) & 0xff];
+    }
+    return res;
+}
+
+void Bitboard::reset_board() {
+    constexpr int center = BOARD_SIZE / 2;
+    m_discs[WHITE] = (uint64{1} << ((center - 1) * BOARD_SIZE + center - 1))
+                   | (uint64{1} << (center * BOARD_SIZE + center));
+    m_discs[BLACK] = (uint64{1} << ((center - 1) * BOARD_SIZE + center))
+                   | (uint64{1} << (center * BOARD_SIZE + center - 1));
+    m_tomove = BLACK;
+    m_hash = calc_hash();
+}
+
+uint64 Bitboard::calc_hash() const {
+    auto res = hash_discs(BLACK, m_discs[BLACK])
+             ^ hash_discs(WHITE, m_discs[WHITE]);
+    if (m_tomove == BLACK) {
+        res ^= Zobrist::zobrist_blacktomove;
+    }
+    return res;
+}
+
+std::vector<int> Bitboard::generate_moves(int color) const {
+    auto moves = get_moves(color);
+    auto result = std::vector<int>{};
+    result.reserve(BOARD_SQUARE_SIZE);
+    while (moves) {
+        result.emplace_back(pop_square(moves));
+    }
+    return result;
+}
+
+uint64 Bitboard::play_move(int square) {
+    return play_move(m_tomove, square);
+}
+
+uint64 Bitboard::play_move(int color, int square) {
+    assert(is_legal(color, square));
+    const auto move = uint64{1} << square;
+    const auto flipped = flips(m_discs[color], m_discs[!color], square);
+    m_discs[color] ^= flipped | move;
+    m_discs[!color] ^= flipped;
+    m_hash ^= hash_discs(color, flipped | move) ^ hash_discs(!color, flipped);
+    set_to_move(!color);
+    return flipped;
+}
+
+void Bitboard::play_pass() {
+    set_to_move(!m_tomove);
+}
+
+void Bitboard::set_to_move(int color) {
+    if (color != m_tomove) {
+        m_hash ^= Zobrist::zobrist_blacktomove;
+    }
+    m_tomove = color;
+}
+
+int Bitboard::get_disc_count(int color) const {
+#if defined(_MSC_VER)
+    return int(__popcnt64(m_discs[color]));
+#else
+    return __builtin_popcountll(m_discs[color]);
+#endif
+}
@@ -0,0 +1,102 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BITBOARD_H_INCLUDED
+#define BITBOARD_H_INCLUDED
+
+#include "config.h"
+#include <array>
+#include <vector>
+
+/*
+    Reversi position as two 64-bit disc masks, square idx is bit
+    y * BOARD_SIZE + x, the same layout as Network::get_occupancy.
+    Legal moves are found with Kogge-Stone fills along the 8
+    directions, 4 directions per AVX2 register when the CPU has it,
+    so the cost does not depend on the number of discs. Playing a move
+    flips every captured disc at once and updates the hash without
+    looking at the flipped discs one by one.
+*/
+class Bitboard {
+public:
+    // Same values as FastBoard::BLACK and FastBoard::WHITE
+    enum color_t : int {
+        BLACK = 0, WHITE = 1
+    };
+
+    Bitboard() {
+        reset_board();
+    }
+
+    // The 4 center discs, black to move
+    void reset_board();
+
+    // Empty squares where color flips at least one disc
+    uint64 get_moves(int color) const {
+        return legal_moves(m_discs[color], m_discs[!color]);
+    }
+    // The moves of get_moves(color) as square indices
+    std::vector<int> generate_moves(int color) const;
+    bool is_legal(int color, int square) const {
+        return (get_moves(color) >> square) & 1;
+    }
+    // Neither side can move
+    bool is_game_over() const {
+        return !get_moves(BLACK) && !get_moves(WHITE);
+    }
+
+    // Plays a legal move of the side to move and returns the flipped discs
+    uint64 play_move(int square);
+    uint64 play_move(int color, int square);
+    void play_pass();
+
+    uint64 get_discs(int color) const {
+        return m_discs[color];
+    }
+    uint64 get_empty() const {
+        return ~(m_discs[BLACK] | m_discs[WHITE]);
+    }
+    int get_to_move() const {
+        return m_tomove;
+    }
+    void set_to_move(int color);
+    int get_disc_count(int color) const;
+
+    uint64 get_hash() const {
+        return m_hash;
+    }
+    // The hash from scratch, get_hash is kept equal to it
+    uint64 calc_hash() const;
+
+    // Moves of own against opp, both as disc masks
+    static uint64 legal_moves(uint64 own, uint64 opp);
+    // Discs of opp flipped by own playing on square
+    static uint64 flips(uint64 own, uint64 opp, int square);
+    // Removes and returns the lowest square of mask, which is not empty
+    static int pop_square(uint64& mask);
+
+private:
+    // Zobrist keys of every disc of color in discs, XOR-linear in discs
+    static uint64 hash_discs(int color, uint64 discs);
+
+    std::array<uint64, 2> m_discs;
+    int m_tomove;
+    uint64 m_hash;
+};
+
+#endif
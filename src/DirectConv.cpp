@@ -0,0 +1,338 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "DirectConv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIRECTCONV_X86
+#include <immintrin.h>
+#endif
+
+// A 3x3 filter reads the rows above and below, so every input plane is
+// stored as 3 copies (shifted by x - 1, x, x + 1) of BOARD_SIZE + 2 rows
+// with zero padding. The filter taps then become whole-row loads.
+constexpr int PAD_ROWS = BOARD_SIZE + 2;
+constexpr int PAD_SHIFT = PAD_ROWS * BOARD_SIZE;
+constexpr int PAD_PLANE = 3 * PAD_SHIFT;
+
+static void pad_input(int channels, int batch_size,
+                      const aligned_vector& input,
+                      aligned_vector& padded) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    padded.resize(batch_size * channels * PAD_PLANE);
+    for (int c = 0; c < channels; c++) {
+        for (int n = 0; n < batch_size; n++) {
+            const float * plane = &input[(c * batch_size + n) * W * H];
+            float * out = &padded[(n * channels + c) * PAD_PLANE];
+            for (int kx = 0; kx < 3; kx++) {
+                float * shifted = out + kx * PAD_SHIFT;
+                std::fill(shifted, shifted + W, 0.0f);
+                std::fill(shifted + (PAD_ROWS - 1) * W,
+                          shifted + PAD_ROWS * W, 0.0f);
+                for (int y = 0; y < H; y++) {
+                    for (int x = 0; x < W; x++) {
+                        const int src = x + kx - 1;
+                        shifted[(y + 1) * W + x] =
+                            (unsigned)src < W ? plane[y * W + src] : 0.0f;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#ifdef DIRECTCONV_X86
+// 2 outputs x 4 rows of 8 squares per block
+__attribute__((target("avx2,fma")))
+static void convolve3_avx2(int outputs, int channels, int batch_size,
+                           const float * padded,
+                           const float * weights,
+                           const float * biases,
+                           float * output,
+                           const float * eltwise) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    constexpr int OB = 2;
+    constexpr int RB = 4;
+    const int filter_dim = channels * 9;
+    const __m256 zero = _mm256_setzero_ps();
+
+    for (int n = 0; n < batch_size; n++) {
+        for (int o = 0; o < outputs; o += OB) {
+            for (int y0 = 0; y0 < H; y0 += RB) {
+                __m256 acc[OB][RB];
+                for (int j = 0; j < OB; j++) {
+                    for (int r = 0; r < RB; r++) {
+                        acc[j][r] = zero;
+                    }
+                }
+                for (int c = 0; c < channels; c++) {
+                    const float * w = weights + o * filter_dim + c * 9;
+                    const float * p = padded
+                        + (n * channels + c) * PAD_PLANE + y0 * W;
+                    for (int kx = 0; kx < 3; kx++) {
+                        __m256 rows[RB + 2];
+                        for (int i = 0; i < RB + 2; i++) {
+                            rows[i] = _mm256_load_ps(p + kx * PAD_SHIFT + i * W);
+                        }
+                        for (int ky = 0; ky < 3; ky++) {
+                            for (int j = 0; j < OB; j++) {
+                                const __m256 wv = _mm256_broadcast_ss(
+                                    w + j * filter_dim + ky * 3 + kx);
+                                for (int r = 0; r < RB; r++) {
+                                    acc[j][r] = _mm256_fmadd_ps(
+                                        wv, rows[r + ky], acc[j][r]);
+                                }
+                            }
+                        }
+                    }
+                }
+                for (int j = 0; j < OB; j++) {
+                    const __m256 bias = _mm256_set1_ps(biases[o + j]);
+                    for (int r = 0; r < RB; r++) {
+                        const int idx = ((o + j) * batch_size + n) * W * H
+                                        + (y0 + r) * W;
+                        __m256 val = _mm256_add_ps(acc[j][r], bias);
+                        if (eltwise) {
+                            val = _mm256_add_ps(val,
+                                                _mm256_loadu_ps(eltwise + idx));
+                        }
+                        _mm256_storeu_ps(output + idx, _mm256_max_ps(val, zero));
+                    }
+                }
+            }
+        }
+    }
+}
+
+// ReLU of every lane. _mm512_max_ps fills the masked lanes from an
+// undefined vector, which GCC 12 reports as maybe uninitialized.
+__attribute__((target("avx512f")))
+static inline __m512 relu_avx512(__m512 val, __m512 zero) {
+    return _mm512_mask_max_ps(zero, __mmask16(0xffff), val, zero);
+}
+
+// 4 outputs x the whole board, 2 rows per vector
+__attribute__((target("avx512f")))
+static void convolve3_avx512(int outputs, int channels, int batch_size,
+                             const float * padded,
+                             const float * weights,
+                             const float * biases,
+                             float * output,
+                             const float * eltwise) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    constexpr int OB = 4;
+    constexpr int VB = H / 2;
+    const int filter_dim = channels * 9;
+    const __m512 zero = _mm512_setzero_ps();
+
+    for (int n = 0; n < batch_size; n++) {
+        for (int o = 0; o < outputs; o += OB) {
+            __m512 acc[OB][VB];
+            for (int j = 0; j < OB; j++) {
+                for (int v = 0; v < VB; v++) {
+                    acc[j][v] = zero;
+                }
+            }
+            for (int c = 0; c < channels; c++) {
+                const float * w = weights + o * filter_dim + c * 9;
+                const float * p = padded + (n * channels + c) * PAD_PLANE;
+                for (int kx = 0; kx < 3; kx++) {
+                    __m512 rows[3][VB];
+                    for (int ky = 0; ky < 3; ky++) {
+                        for (int v = 0; v < VB; v++) {
+                            rows[ky][v] = _mm512_loadu_ps(
+                                p + kx * PAD_SHIFT + (2 * v + ky) * W);
+                        }
+                    }
+                    for (int j = 0; j < OB; j++) {
+                        for (int ky = 0; ky < 3; ky++) {
+                            const __m512 wv = _mm512_set1_ps(
+                                w[j * filter_dim + ky * 3 + kx]);
+                            for (int v = 0; v < VB; v++) {
+                                acc[j][v] = _mm512_fmadd_ps(
+                                    wv, rows[ky][v], acc[j][v]);
+                            }
+                        }
+                    }
+                }
+            }
+            for (int j = 0; j < OB; j++) {
+                const __m512 bias = _mm512_set1_ps(biases[o + j]);
+                for (int v = 0; v < VB; v++) {
+                    const int idx = ((o + j) * batch_size + n) * W * H
+                                    + v * 2 * W;
+                    __m512 val = _mm512_add_ps(acc[j][v], bias);
+                    if (eltwise) {
+                        val = _mm512_add_ps(val, _mm512_loadu_ps(eltwise + idx));
+                    }
+                    _mm512_storeu_ps(output + idx, relu_avx512(val, zero));
+                }
+            }
+        }
+    }
+}
+
+// 3 outputs x the whole board, enough for both heads in one pass
+__attribute__((target("avx512f")))
+static void convolve1_avx512(int outputs, int channels, int batch_size,
+                             const float * input,
+                             const float * weights,
+                             const float * biases,
+                             float * output) {
+    constexpr int SPATIAL = BOARD_SIZE * BOARD_SIZE;
+    constexpr int OB = 3;
+    constexpr int VB = SPATIAL / 16;
+    const __m512 zero = _mm512_setzero_ps();
+
+    for (int n = 0; n < batch_size; n++) {
+        for (int o = 0; o < outputs; o += OB) {
+            // Missing outputs of the last block repeat the last one
+            // and are not stored
+            const float * w[OB];
+            for (int j = 0; j < OB; j++) {
+                w[j] = &weights[std::min(o + j, outputs - 1) * channels];
+            }
+            __m512 acc[OB][VB];
+            for (int j = 0; j < OB; j++) {
+                for (int v = 0; v < VB; v++) {
+                    acc[j][v] = zero;
+                }
+            }
+            for (int c = 0; c < channels; c++) {
+                const float * plane = input + (c * batch_size + n) * SPATIAL;
+                __m512 in[VB];
+                for (int v = 0; v < VB; v++) {
+                    in[v] = _mm512_loadu_ps(plane + v * 16);
+                }
+                for (int j = 0; j < OB; j++) {
+                    const __m512 wv = _mm512_set1_ps(w[j][c]);
+                    for (int v = 0; v < VB; v++) {
+                        acc[j][v] = _mm512_fmadd_ps(wv, in[v], acc[j][v]);
+                    }
+                }
+            }
+            for (int j = 0; j < OB && o + j < outputs; j++) {
+                const __m512 bias = _mm512_set1_ps(biases[o + j]);
+                float * out = output + ((o + j) * batch_size + n) * SPATIAL;
+                for (int v = 0; v < VB; v++) {
+                    _mm512_storeu_ps(out + v * 16,
+                        relu_avx512(_mm512_add_ps(acc[j][v], bias), zero));
+                }
+            }
+        }
+    }
+}
+#endif
+
+static DirectConv::ISA detect_isa(void) {
+#ifdef DIRECTCONV_X86
+    // The kernels hold board rows in vector registers
+    if (BOARD_SIZE != 8) {
+        return DirectConv::NONE;
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return DirectConv::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return DirectConv::AVX2;
+    }
+#endif
+    return DirectConv::NONE;
+}
+
+DirectConv::ISA DirectConv::get_isa(void) {
+    static const ISA s_isa = detect_isa();
+    return s_isa;
+}
+
+const char * DirectConv::get_isa_name(void) {
+    switch (get_isa()) {
+    case AVX512:
+        return "AVX-512";
+    case AVX2:
+        return "AVX2";
+    default:
+        return "none";
+    }
+}
+
+bool DirectConv::can_convolve3(int outputs) {
+    switch (get_isa()) {
+    case AVX512:
+        return outputs % 4 == 0;
+    case AVX2:
+        return outputs % 2 == 0;
+    default:
+        return false;
+    }
+}
+
+bool DirectConv::can_convolve1(void) {
+    // A 1x1 convolution is bound by memory bandwidth, with AVX2 the
+    // BLAS GEMM is faster
+    return get_isa() == AVX512;
+}
+
+void DirectConv::convolve3(int outputs, int batch_size,
+                           const aligned_vector& input,
+                           const std::vector<float>& weights,
+                           const std::vector<float>& biases,
+                           aligned_vector& output,
+                           const float * eltwise) {
+    assert(can_convolve3(outputs));
+    const int channels = weights.size() / (outputs * 9);
+    assert(output.size() >= size_t(outputs * batch_size
+                                   * BOARD_SQUARE_SIZE));
+    auto& padded = Workspace::get_thread_buffers().padded;
+    pad_input(channels, batch_size, input, padded);
+#ifdef DIRECTCONV_X86
+    if (get_isa() == AVX512) {
+        convolve3_avx512(outputs, channels, batch_size, padded.data(),
+                         weights.data(), biases.data(), output.data(),
+                         eltwise);
+    } else {
+        convolve3_avx2(outputs, channels, batch_size, padded.data(),
+                       weights.data(), biases.data(), output.data(),
+                       eltwise);
+    }
+#endif
+}
+
+void DirectConv::convolve1(int outputs, int batch_size,
+                           const aligned_vector& input,
+                           const std::vector<float>& weights,
+                           const std::vector<float>& biases,
+                           aligned_vector& output) {
+    assert(can_convolve1());
+    const int channels = weights.size() / outputs;
+    assert(output.size() >= size_t(outputs * batch_size
+                                   * BOARD_SQUARE_SIZE));
+#ifdef DIRECTCONV_X86
+    convolve1_avx512(outputs, channels, batch_size, input.data(),
+                     weights.data(), biases.data(), output.data());
+#endif
+}
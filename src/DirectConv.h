@@ -0,0 +1,68 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DIRECTCONV_H_INCLUDED
+#define DIRECTCONV_H_INCLUDED
+
+#include "config.h"
+#include <vector>
+
+#include "Workspace.h"
+
+/*
+    SIMD convolutions specialized for an 8x8 board. A board row is
+    exactly one AVX2 vector (two rows per AVX-512 vector), so the
+    [channels][batch_size][8][8] activations are already blocked by row
+    and the filters are applied with broadcast FMAs, without an im2col
+    buffer or a GEMM call. The kernels are compiled for their instruction
+    set regardless of the build flags and picked at runtime from CPUID.
+
+    Both convolutions add the bias and the (optional) residual eltwise
+    and apply ReLU, like the BLAS ones.
+*/
+namespace DirectConv {
+    enum ISA {
+        NONE, AVX2, AVX512
+    };
+
+    // Best instruction set the CPU supports, NONE means use BLAS
+    ISA get_isa(void);
+    const char * get_isa_name(void);
+
+    // Whether convolve3 handles a layer with this many outputs
+    bool can_convolve3(int outputs);
+    bool can_convolve1(void);
+
+    // weights are [outputs][channels][3][3], input, output and eltwise
+    // are [channels][batch_size][BOARD_SQUARE_SIZE]
+    void convolve3(int outputs, int batch_size,
+                   const aligned_vector& input,
+                   const std::vector<float>& weights,
+                   const std::vector<float>& biases,
+                   aligned_vector& output,
+                   const float * eltwise = nullptr);
+
+    // weights are [outputs][channels]
+    void convolve1(int outputs, int batch_size,
+                   const aligned_vector& input,
+                   const std::vector<float>& weights,
+                   const std::vector<float>& biases,
+                   aligned_vector& output);
+}
+
+#endif
@@ -23,12 +23,17 @@
 #include <vector>
 #include <algorithm>
 #include "Utils.h"
+#include "Workspace.h"
 
 //卷积转化为矩阵相乘
+// input is laid out as [channels][batch_size][height * width], output
+// as [channels * filter_size * filter_size][batch_size * height * width],
+// so that a single GEMM covers every board in the batch.
 template <unsigned long filter_size>
 void im2col(const int channels,
-            const std::vector<float>& input,
-            std::vector<float>& output) {
+            const int batch_size,
+            const aligned_vector& input,
+            aligned_vector& output) {
     constexpr unsigned int height = BOARD_SIZE;
     constexpr unsigned int width = BOARD_SIZE;
     constexpr unsigned int channel_size = height * width;
@@ -40,28 +45,32 @@ void im2col(const int channels,
     const float* data_im = input.data();
     float* data_col = output.data();
 
-    for (int channel = channels; channel--; data_im += channel_size) {
+    for (int channel = channels; channel--;
+         data_im += channel_size * batch_size) {
         for (unsigned int kernel_row = 0; kernel_row < filter_size; kernel_row++) {
             for (unsigned int kernel_col = 0; kernel_col < filter_size; kernel_col++) {
-                int input_row = -pad + kernel_row;
-                for (int output_rows = output_h; output_rows; output_rows--) {
-                    if ((unsigned)input_row < height) {
-                        int input_col = -pad + kernel_col;
-                        for (int output_col = output_w; output_col; output_col--) {
-                            if ((unsigned)input_col < width) {
-                                *(data_col++) =
-                                    data_im[input_row * width + input_col];
-                            } else {
+                for (int n = 0; n < batch_size; n++) {
+                    const float* board_im = data_im + n * channel_size;
+                    int input_row = -pad + kernel_row;
+                    for (int output_rows = output_h; output_rows; output_rows--) {
+                        if ((unsigned)input_row < height) {
+                            int input_col = -pad + kernel_col;
+                            for (int output_col = output_w; output_col; output_col--) {
+                                if ((unsigned)input_col < width) {
+                                    *(data_col++) =
+                                        board_im[input_row * width + input_col];
+                                } else {
+                                    *(data_col++) = 0;
+                                }
+                                input_col++;
+                            }
+                        } else {
+                            for (int output_cols = output_w; output_cols; output_cols--) {
                                 *(data_col++) = 0;
                             }
-                            input_col++;
-                        }
-                    } else {
-                        for (int output_cols = output_w; output_cols; output_cols--) {
-                            *(data_col++) = 0;
                         }
+                        input_row++;
                     }
-                    input_row++;
                 }
             }
         }
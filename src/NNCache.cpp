@@ -0,0 +1,161 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "NNCache.h"
+#include "FastBoard.h"
+#include "Symmetry.h"
+#include "Utils.h"
+#include "Zobrist.h"
+
+using namespace Utils;
+
+int cfg_nn_cache_size = 100000;
+
+NNCache& NNCache::get_NNCache(void) {
+    static NNCache s_nncache;
+    return s_nncache;
+}
+
+void NNCache::resize(size_t size) {
+    // Not safe against concurrent lookups, only call when idle
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+    m_entries.resize(size);
+    reset_stats();
+}
+
+size_t NNCache::get_size(void) const {
+    return m_entries.size();
+}
+
+SMP::Mutex& NNCache::get_mutex(size_t index) {
+    return m_mutexes[index % NUM_STRIPES];
+}
+
+NNCache::Key NNCache::get_key(const GameState * state) {
+    static_assert(FastBoard::MAXSQ >= BOARD_SQUARE_SIZE,
+                  "Zobrist tables are indexed by board square");
+    auto stones = Network::get_occupancy(state);
+    auto key = Key{0, 0};
+    for (auto s = 0; s < Symmetry::NUM_SYMMETRIES; s++) {
+        auto hash = uint64{0};
+        if (state->get_to_move() == FastBoard::BLACK) {
+            hash ^= Zobrist::zobrist_blacktomove;
+        }
+        for (auto color : {FastBoard::BLACK, FastBoard::WHITE}) {
+            auto mask = Symmetry::transform_mask(stones[color], s);
+            for (auto idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+                if ((mask >> idx) & 1) {
+                    hash ^= Zobrist::zobrist[color][idx];
+                }
+            }
+        }
+        // The smallest hash picks the canonical orientation
+        if (s == 0 || hash < key.hash) {
+            key.hash = hash;
+            key.symmetry = s;
+        }
+    }
+    return key;
+}
+
+bool NNCache::lookup(const GameState * state, const Key& key,
+                     Network::Netresult& result) {
+    if (m_entries.empty()) {
+        return false;
+    }
+    m_lookups++;
+
+    auto index = key.hash % m_entries.size();
+    Entry entry;
+    {
+        LOCK(get_mutex(index), lock);
+        if (m_entries[index].m_hash != key.hash) {
+            return false;
+        }
+        entry = m_entries[index];
+    }
+    m_hits++;
+
+    // Map the canonical policy back onto this position
+    auto& moves = result.first;
+    moves.clear();
+    for (auto idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+        auto sq = Symmetry::transform_index(idx, key.symmetry);
+        auto vtx = state->board.get_vertex(sq % BOARD_SIZE, sq / BOARD_SIZE);
+        if (state->board.get_square(vtx) == FastBoard::EMPTY) {
+            moves.emplace_back(entry.m_policy[idx], vtx);
+        }
+    }
+    moves.emplace_back(entry.m_policy[BOARD_SQUARE_SIZE], FastBoard::PASS);
+    result.second = entry.m_winrate;
+    return true;
+}
+
+void NNCache::insert(const GameState * state, const Key& key,
+                     const Network::Netresult& result) {
+    if (m_entries.empty()) {
+        return;
+    }
+    m_inserts++;
+
+    // Board square -> square of the canonical orientation
+    std::array<int, BOARD_SQUARE_SIZE> canonical;
+    for (auto idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+        canonical[Symmetry::transform_index(idx, key.symmetry)] = idx;
+    }
+
+    Entry entry;
+    entry.m_hash = key.hash;
+    entry.m_winrate = result.second;
+    entry.m_policy.fill(0.0f);
+    for (const auto& node : result.first) {
+        if (node.second == FastBoard::PASS) {
+            entry.m_policy[BOARD_SQUARE_SIZE] = node.first;
+        } else {
+            auto xy = state->board.get_xy(node.second);
+            auto sq = xy.second * BOARD_SIZE + xy.first;
+            entry.m_policy[canonical[sq]] = node.first;
+        }
+    }
+
+    auto index = key.hash % m_entries.size();
+    LOCK(get_mutex(index), lock);
+    m_entries[index] = entry;
+}
+
+void NNCache::dump_stats(void) {
+    auto lookups = m_lookups.load();
+    auto hits = m_hits.load();
+    myprintf("NN cache: %llu/%llu hits (%.1f%%), %llu inserts, "
+             "%d entries, %.1f MiB\n",
+             hits, lookups, lookups ? 100.0 * hits / lookups : 0.0,
+             m_inserts.load(), int(m_entries.size()),
+             double(m_entries.size() * sizeof(Entry)) / (1024 * 1024));
+}
+
+void NNCache::reset_stats(void) {
+    m_lookups = 0;
+    m_hits = 0;
+    m_inserts = 0;
+}
@@ -0,0 +1,93 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNCACHE_H_INCLUDED
+#define NNCACHE_H_INCLUDED
+
+#include "config.h"
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include "GameState.h"
+#include "Network.h"
+#include "SMP.h"
+
+// Amount of positions the evaluation cache holds, 0 disables it
+extern int cfg_nn_cache_size;
+
+/*
+    Cache of network evaluations. Positions that are symmetric to each
+    other share an entry: the key is the hash of the canonical
+    orientation, and the policy is stored in that orientation.
+*/
+class NNCache {
+public:
+    struct Key {
+        uint64 hash;
+        // Symmetry that maps the position onto the canonical one
+        int symmetry;
+    };
+
+    /*
+        return the global evaluation cache
+    */
+    static NNCache& get_NNCache(void);
+
+    /*
+        drop all entries and hold this many from now on
+    */
+    void resize(size_t size);
+    size_t get_size(void) const;
+
+    static Key get_key(const GameState * state);
+
+    /*
+        fill result if the position is in the cache
+    */
+    bool lookup(const GameState * state, const Key& key,
+                Network::Netresult& result);
+    void insert(const GameState * state, const Key& key,
+                const Network::Netresult& result);
+
+    void dump_stats(void);
+    void reset_stats(void);
+
+private:
+    struct Entry {
+        uint64 m_hash{0};
+        float m_winrate;
+        // Board squares in the canonical orientation, then pass
+        std::array<float, BOARD_ACTION_N> m_policy;
+    };
+
+    static constexpr size_t NUM_STRIPES = 64;
+
+    NNCache() = default;
+    SMP::Mutex& get_mutex(size_t index);
+
+    std::array<SMP::Mutex, NUM_STRIPES> m_mutexes;
+    std::vector<Entry> m_entries;
+
+    // Statistics
+    std::atomic<uint64> m_lookups{0};
+    std::atomic<uint64> m_hits{0};
+    std::atomic<uint64> m_inserts{0};
+};
+
+#endif
@@ -0,0 +1,257 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <exception>
+
+#include "NNQueue.h"
+#include "Random.h"
+#include "Symmetry.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+int cfg_nn_batch_size = 16;
+int cfg_nn_batch_wait_us = 100;
+int cfg_nn_workers = 0;
+
+NNQueue& NNQueue::get_NNQueue(void) {
+    static NNQueue s_nnqueue;
+    return s_nnqueue;
+}
+
+void NNQueue::initialize(int workers, int batch_size, int batch_wait_us) {
+    assert(!m_running);
+    assert(workers > 0 && batch_size > 0);
+    m_batch_size = batch_size;
+    m_batch_wait = std::chrono::microseconds(batch_wait_us);
+    m_exit = false;
+    for (int i = 0; i < workers; i++) {
+        m_worker_data.emplace_back(std::make_unique<WorkerData>());
+        auto& data = *m_worker_data.back();
+        data.batch.reserve(batch_size);
+        m_workers.emplace_back([this, &data] { worker(data); });
+    }
+    m_running = true;
+    myprintf("Evaluation queue: %d thread(s), batches of %d, %d us wait\n",
+             workers, batch_size, batch_wait_us);
+}
+
+bool NNQueue::is_running(void) const {
+    return m_running;
+}
+
+NNQueue::~NNQueue() {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_condvar.notify_all();
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+std::unique_ptr<NNQueue::Request> NNQueue::make_request(
+    Network& network, GameState * state,
+    Network::Ensemble ensemble, int rotation) {
+    auto request = std::unique_ptr<Request>{};
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_free_requests.empty()) {
+            request = std::move(m_free_requests.back());
+            m_free_requests.pop_back();
+        }
+    }
+    if (!request) {
+        request = std::make_unique<Request>();
+    }
+    // The promise of a recycled request was already satisfied
+    request->promise = std::promise<Network::Netresult>{};
+    // An AVERAGE ensemble is a batch of its own, see get_scored_moves
+    assert(ensemble != Network::AVERAGE);
+    if (ensemble == Network::RANDOM_ROTATION) {
+        assert(rotation == -1);
+        rotation = Random::get_Rng().randfix<Symmetry::NUM_SYMMETRIES>();
+    }
+    assert(rotation >= 0 && rotation < Symmetry::NUM_SYMMETRIES);
+    request->network = &network;
+    request->state = state;
+    request->rotation = rotation;
+    Network::gather_features(state, request->planes);
+    return request;
+}
+
+std::future<Network::Netresult> NNQueue::post(Network& network,
+                                              GameState * state,
+                                              Network::Ensemble ensemble,
+                                              int rotation) {
+    auto request = make_request(network, state, ensemble, rotation);
+    auto result = request->promise.get_future();
+    enqueue(std::move(request));
+    return result;
+}
+
+void NNQueue::post(Network& network, GameState * state,
+                   Network::Ensemble ensemble,
+                   int rotation, Callback callback) {
+    auto request = make_request(network, state, ensemble, rotation);
+    request->callback = std::move(callback);
+    enqueue(std::move(request));
+}
+
+void NNQueue::enqueue(std::unique_ptr<Request> request) {
+    request->posted = Clock::now();
+    bool full;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queue.emplace_back(std::move(request));
+        full = m_queue.size() >= m_batch_size;
+    }
+    // Wake up a worker that is waiting for its batch to fill
+    if (full) {
+        m_condvar.notify_all();
+    } else {
+        m_condvar.notify_one();
+    }
+}
+
+void NNQueue::worker(WorkerData& data) {
+    auto& batch = data.batch;
+    for (;;) {
+        assert(batch.empty());
+        auto leftover = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condvar.wait(lock, [this]{ return m_exit || !m_queue.empty(); });
+            if (m_exit && m_queue.empty()) {
+                return;
+            }
+            // Give the batch a chance to fill up, but never keep the
+            // oldest request waiting for longer than m_batch_wait.
+            auto deadline = m_queue.front()->posted + m_batch_wait;
+            m_condvar.wait_until(lock, deadline, [this]{
+                return m_exit || m_queue.size() >= m_batch_size;
+            });
+            // The oldest request picks the network of the batch
+            for (auto it = begin(m_queue);
+                 it != end(m_queue) && batch.size() < m_batch_size;) {
+                if (batch.empty() || (*it)->network == batch.front()->network) {
+                    batch.emplace_back(std::move(*it));
+                    it = m_queue.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            leftover = !m_queue.empty();
+        }
+        // Another worker took the requests
+        if (batch.empty()) {
+            continue;
+        }
+        // The requests left behind need not wait for this batch
+        if (leftover) {
+            m_condvar.notify_one();
+        }
+        run_batch(data);
+        recycle(batch);
+    }
+}
+
+void NNQueue::recycle(std::vector<std::unique_ptr<Request>>& batch) {
+    for (auto& request : batch) {
+        request->callback = nullptr;
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (auto& request : batch) {
+        m_free_requests.emplace_back(std::move(request));
+    }
+    batch.clear();
+}
+
+void NNQueue::run_batch(WorkerData& data) {
+    auto& batch = data.batch;
+    auto& states = data.states;
+    auto& planes = data.planes;
+    auto& rotations = data.rotations;
+    auto& results = data.results;
+    states.clear();
+    planes.clear();
+    rotations.clear();
+    auto now = Clock::now();
+    for (auto& request : batch) {
+        auto waited = uint64(std::chrono::duration_cast<std::chrono::microseconds>(
+            now - request->posted).count());
+        atomic_add(m_wait_us, waited);
+        auto max_wait = m_max_wait_us.load();
+        while (waited > max_wait
+               && !m_max_wait_us.compare_exchange_weak(max_wait, waited));
+        states.emplace_back(request->state);
+        planes.emplace_back(request->planes);
+        rotations.emplace_back(request->rotation);
+    }
+    m_batches++;
+    m_positions += batch.size();
+
+    try {
+        auto network = batch.front()->network;
+        network->get_scored_moves_internal(states, planes, rotations, results);
+    } catch (const std::exception& e) {
+        for (auto& request : batch) {
+            // Callbacks have no way to receive an error
+            if (request->callback) {
+                myprintf("Error in network evaluation: %s\n", e.what());
+                exit(EXIT_FAILURE);
+            }
+            request->promise.set_exception(std::current_exception());
+        }
+        return;
+    }
+    for (auto i = size_t{0}; i < batch.size(); i++) {
+        if (batch[i]->callback) {
+            batch[i]->callback(results[i]);
+        } else {
+            batch[i]->promise.set_value(std::move(results[i]));
+        }
+    }
+}
+
+void NNQueue::dump_stats(void) {
+    auto batches = m_batches.load();
+    auto positions = m_positions.load();
+    if (batches == 0) {
+        return;
+    }
+    myprintf("Evaluation queue: %llu positions in %llu batches, "
+             "%.1f%% batch fill\n",
+             positions, batches,
+             100.0 * positions / (batches * m_batch_size));
+    myprintf("Queue wait: %.1f us average, %llu us max\n",
+             double(m_wait_us.load()) / positions, m_max_wait_us.load());
+}
+
+void NNQueue::reset_stats(void) {
+    m_batches = 0;
+    m_positions = 0;
+    m_wait_us = 0;
+    m_max_wait_us = 0;
+}
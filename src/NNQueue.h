@@ -0,0 +1,140 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNQUEUE_H_INCLUDED
+#define NNQUEUE_H_INCLUDED
+
+#include "config.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "GameState.h"
+#include "Network.h"
+
+// Maximum amount of positions in one forward pass
+extern int cfg_nn_batch_size;
+// Time a partial batch waits for more positions, in microseconds
+extern int cfg_nn_batch_wait_us;
+// Amount of evaluation threads, 0 = pick automatically
+extern int cfg_nn_workers;
+
+/*
+    Central network evaluator. Search threads post positions, and the
+    worker threads collect them into batches that go through the network
+    in a single forward pass. Positions of different networks share the
+    workers, but never a batch.
+*/
+class NNQueue {
+public:
+    using Callback = std::function<void(Network::Netresult&)>;
+
+    /*
+        return the global evaluation queue
+    */
+    static NNQueue& get_NNQueue(void);
+
+    /*
+        start the worker threads
+    */
+    void initialize(int workers, int batch_size, int batch_wait_us);
+    bool is_running(void) const;
+
+    /*
+        queue a position for evaluation. The features are gathered on
+        the calling thread, but state must stay alive and unmodified until
+        the result is delivered.
+    */
+    std::future<Network::Netresult> post(Network& network,
+                                         GameState * state,
+                                         Network::Ensemble ensemble,
+                                         int rotation = -1);
+    /*
+        as above, but callback is run on an evaluation thread
+    */
+    void post(Network& network, GameState * state,
+              Network::Ensemble ensemble,
+              int rotation, Callback callback);
+
+    void dump_stats(void);
+    void reset_stats(void);
+
+    ~NNQueue();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        Network * network;
+        GameState * state;
+        Network::NNPlanes planes;
+        int rotation;
+        std::promise<Network::Netresult> promise;
+        Callback callback;
+        Clock::time_point posted;
+    };
+
+    // The vectors of one worker thread, reused by all its batches
+    struct WorkerData {
+        std::vector<std::unique_ptr<Request>> batch;
+        std::vector<GameState*> states;
+        std::vector<Network::NNPlanes> planes;
+        std::vector<int> rotations;
+        std::vector<Network::Netresult> results;
+    };
+
+    NNQueue() = default;
+    // A request with the features of state, taken from the pool of
+    // delivered requests when it has one. The callback is left to the
+    // caller.
+    std::unique_ptr<Request> make_request(Network& network,
+                                          GameState * state,
+                                          Network::Ensemble ensemble,
+                                          int rotation);
+    void enqueue(std::unique_ptr<Request> request);
+    void worker(WorkerData& data);
+    void run_batch(WorkerData& data);
+    // Returns the delivered requests of the batch to the pool
+    void recycle(std::vector<std::unique_ptr<Request>>& batch);
+
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    std::deque<std::unique_ptr<Request>> m_queue;
+    std::vector<std::unique_ptr<Request>> m_free_requests;
+    std::vector<std::unique_ptr<WorkerData>> m_worker_data;
+    std::vector<std::thread> m_workers;
+    size_t m_batch_size{1};
+    std::chrono::microseconds m_batch_wait{0};
+    bool m_exit{false};
+    std::atomic<bool> m_running{false};
+
+    // Statistics
+    std::atomic<uint64> m_batches{0};
+    std::atomic<uint64> m_positions{0};
+    std::atomic<uint64> m_wait_us{0};
+    std::atomic<uint64> m_max_wait_us{0};
+};
+
+#endif
@@ -26,11 +26,16 @@
 #include <memory>
 #include <cmath>
 #include <array>
+#include <limits>
+#include <stdexcept>
 #include <thread>
 #include <boost/utility.hpp>
 #include <boost/format.hpp>
 
+#include "DirectConv.h"
 #include "Im2Col.h"
+#include "Quantize.h"
+#include "Winograd.h"
 #ifdef __APPLE__
 #include <Accelerate/Accelerate.h>
 #endif
@@ -51,39 +56,104 @@
 #include "FastBoard.h"
 #include "Random.h"
 #include "Network.h"
+#include "NNCache.h"
+#include "NNQueue.h"
+#include "Symmetry.h"
+#include "Weights.h"
+#include "Workspace.h"
 #include "GTP.h"
 #include "Utils.h"
 
 using namespace Utils;
 
-// Input + residual block tower
-std::vector<std::vector<float>> conv_weights;
-std::vector<std::vector<float>> conv_biases;
-std::vector<std::vector<float>> batchnorm_means;
-std::vector<std::vector<float>> batchnorm_variances;
+#ifdef USE_OPENCL
+// Run the residual tower on the CPU instead of the OpenCL device
+bool cfg_cpu_only = false;
+#endif
+// Use Winograd F(4x4,3x3) for the 3x3 convolutions
+bool cfg_winograd = true;
+// Use the SIMD convolutions when the CPU supports them
+bool cfg_direct_conv = true;
+// Run the residual tower in int8
+bool cfg_int8 = false;
+
+struct NetworkWeights {
+    // Input + residual block tower, with the batchnorm layers folded in
+    std::vector<std::vector<float>> conv_weights;
+    std::vector<std::vector<float>> conv_biases;
+    // conv_weights after the Winograd filter transform
+    std::vector<std::vector<float>> conv_weights_winograd;
+    // conv_weights quantized to int8, empty for layers that can't be
+    std::vector<QuantizedFilter> conv_weights_int8;
+
+    // 1x1 convolutions of both heads: 2 policy planes, then 1 value plane
+    std::vector<float> head_conv_w;
+    std::vector<float> head_conv_b;
+
+    // Policy head
+    std::vector<float> ip_pol_w;
+    std::vector<float> ip_pol_b;
+
+    // Value head
+    std::vector<float> ip1_val_w;
+    std::vector<float> ip1_val_b;
+
+    std::vector<float> ip2_val_w;
+    std::vector<float> ip2_val_b;
+
+    // Mixed into the evaluation cache keys, so that networks never see
+    // each other's entries
+    uint64 cache_salt;
 
-// Policy head
-std::vector<float> conv_pol_w;
-std::vector<float> conv_pol_b;
-std::array<float, 2> bn_pol_w1;
-std::array<float, 2> bn_pol_w2;
+#ifdef USE_OPENCL
+    // The same weights on every OpenCL device
+    std::unique_ptr<OpenCLReplicas> opencl;
+#endif
+};
 
-std::array<float, BOARD_SQUARE_SIZE*2*BOARD_ACTION_N> ip_pol_w;
-std::array<float, BOARD_ACTION_N> ip_pol_b;
+Network& Network::get_Network(void) {
+    static Network s_network;
+    return s_network;
+}
+
+Network::ConvMode Network::get_conv_mode(void) {
+    return ConvMode{cfg_winograd, cfg_direct_conv, cfg_int8};
+}
 
-// Value head
-std::vector<float> conv_val_w;
-std::vector<float> conv_val_b;
-std::array<float, 1> bn_val_w1;
-std::array<float, 1> bn_val_w2;
+std::shared_ptr<const NetworkWeights> Network::get_weights(void) const {
+    return std::atomic_load(&m_weights);
+}
 
-std::array<float, BOARD_SQUARE_SIZE*256> ip1_val_w;
-std::array<float, 256> ip1_val_b;
+bool Network::check_allocations(GameState * state) {
+    constexpr int batch_size = 16;
+    constexpr int BATCHES = 100;
+    // Cache hits would skip the forward pass
+    auto& nncache = NNCache::get_NNCache();
+    const auto cache_size = nncache.get_size();
+    nncache.resize(0);
+
+    GameState mystate = *state;
+    auto states = std::vector<GameState*>(batch_size, &mystate);
+    for (int loop = 0; loop < 2; loop++) {
+        auto vec = get_scored_moves_batch(states, Ensemble::RANDOM_ROTATION);
+    }
+    const auto allocations = Workspace::get_allocations();
+    for (int loop = 0; loop < BATCHES; loop++) {
+        auto vec = get_scored_moves_batch(states, Ensemble::RANDOM_ROTATION);
+    }
+    const auto grown = Workspace::get_allocations() - allocations;
+    nncache.resize(cache_size);
 
-std::array<float, 256> ip2_val_w;
-std::array<float, 1> ip2_val_b;
+    myprintf("Workspace allocations in %d batches: %llu%s\n", BATCHES,
+             grown, grown == 0 ? "" : " (FAILED, expected 0)");
+    return grown == 0;
+}
 
-void Network::benchmark(GameState * state) {
+bool Network::benchmark(GameState * state) {
+    // Measure the network, not the cache
+    auto& nncache = NNCache::get_NNCache();
+    const auto cache_size = nncache.get_size();
+    nncache.resize(0);
     {
         int BENCH_AMOUNT = 1600;
         int cpus = cfg_num_threads;
@@ -93,7 +163,7 @@ void Network::benchmark(GameState * state) {
 
         ThreadGroup tg(thread_pool);
         for (int i = 0; i < cpus; i++) {
-            tg.add_task([iters_per_thread, state]() {
+            tg.add_task([this, iters_per_thread, state]() {
                 GameState mystate = *state;
                 for (int loop = 0; loop < iters_per_thread; loop++) {
                     auto vec = get_scored_moves(&mystate, Ensemble::RANDOM_ROTATION);
@@ -108,138 +178,455 @@ void Network::benchmark(GameState * state) {
                  BENCH_AMOUNT,
                  (float)Time::timediff(start,end)/100.0,
                  (int)((float)BENCH_AMOUNT/((float)Time::timediff(start,end)/100.0)));
+        NNQueue::get_NNQueue().dump_stats();
     }
-}
+    // Single thread, batched evaluations
+    for (auto batch_size : {1, 2, 4, 8, 16, 32, 64}) {
+        int BENCH_AMOUNT = 1600;
+        int batches = (BENCH_AMOUNT + (batch_size - 1)) / batch_size;
+        int evals = batches * batch_size;
 
-void Network::initialize(void) {
-#ifdef USE_OPENCL
-    myprintf("Initializing OpenCL\n");
-    opencl.initialize();
-
-    // Count size of the network
-    myprintf("Detecting residual layers...");
-    std::ifstream wtfile(cfg_weightsfile);
-    if (wtfile.fail()) {
-        myprintf("Could not open weights file: %s\n", cfg_weightsfile.c_str());
-        exit(EXIT_FAILURE);
+        GameState mystate = *state;
+        auto states = std::vector<GameState*>(batch_size, &mystate);
+
+        Time start;
+        for (int loop = 0; loop < batches; loop++) {
+            auto vec = get_scored_moves_batch(states, Ensemble::RANDOM_ROTATION);
+        }
+        Time end;
+
+        myprintf("batch %2d: %5d evaluations in %5.2f seconds -> %d n/s\n",
+                 batch_size, evals,
+                 (float)Time::timediff(start,end)/100.0,
+                 (int)((float)evals/((float)Time::timediff(start,end)/100.0)));
     }
-    std::string line;
-    auto linecount = size_t{0};
-    auto format_version = -1;
-    while (std::getline(wtfile, line)) {
-        std::stringstream iss(line);
-        // First line is the file format version id
-        if (linecount == 0) {
-           iss >> format_version;
-           if (iss.fail() || format_version != FORMAT_VERSION) {
-               myprintf("Weights file is the wrong version.\n");
-               exit(EXIT_FAILURE);
-           } else {
-               myprintf("v%d...", format_version);
-           }
+    // 8-way symmetry ensemble, one batch of 8 per evaluation
+    {
+        int BENCH_AMOUNT = 200;
+        GameState mystate = *state;
+
+        Time start;
+        for (int loop = 0; loop < BENCH_AMOUNT; loop++) {
+            auto vec = get_scored_moves(&mystate, Ensemble::AVERAGE);
+        }
+        Time end;
+
+        myprintf("average: %5d evaluations in %5.2f seconds -> %d n/s\n",
+                 BENCH_AMOUNT,
+                 (float)Time::timediff(start,end)/100.0,
+                 (int)((float)BENCH_AMOUNT/((float)Time::timediff(start,end)/100.0)));
+    }
+    // Once the workspace has grown, evaluations should not allocate
+    const auto allocations_ok = check_allocations(state);
+    // Evaluations served from the cache
+    nncache.resize(cache_size);
+    if (cache_size > 0) {
+        int BENCH_AMOUNT = 100000;
+        GameState mystate = *state;
+
+        Time start;
+        for (int loop = 0; loop < BENCH_AMOUNT; loop++) {
+            auto vec = get_scored_moves(&mystate, Ensemble::RANDOM_ROTATION);
         }
-        // Third line of parameters are the convolution layer biases,
-        // so this tells us the amount of channels in the residual layers.
-        // (Provided they're all equally large - that's not actually required!)
-        if (linecount == 2) {
-            auto count = std::distance(std::istream_iterator<std::string>(iss),
-                                       std::istream_iterator<std::string>());
-            myprintf("%d channels...", count);
+        Time end;
+
+        myprintf("cache: %5d evaluations in %5.2f seconds -> %d n/s\n",
+                 BENCH_AMOUNT,
+                 (float)Time::timediff(start,end)/100.0,
+                 (int)((float)BENCH_AMOUNT/((float)Time::timediff(start,end)/100.0)));
+        nncache.dump_stats();
+        nncache.resize(cache_size);
+    }
+#ifdef USE_BLAS
+    // 3x3 convolution algorithms for the BLAS tower
+    for (auto batch_size : {1, 16}) {
+        constexpr int BENCH_AMOUNT = 800;
+        const int batches = (BENCH_AMOUNT + (batch_size - 1)) / batch_size;
+        const int evals = batches * batch_size;
+        const auto weights = get_weights();
+
+        NNPlanes planes;
+        GameState mystate = *state;
+        gather_features(&mystate, planes);
+        auto input = aligned_vector(INPUT_CHANNELS * BOARD_SQUARE_SIZE * batch_size);
+        for (auto c = 0; c < INPUT_CHANNELS; c++) {
+            for (auto n = 0; n < batch_size; n++) {
+                for (auto idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+                    input[(c * batch_size + n) * BOARD_SQUARE_SIZE + idx] =
+                        (float)planes[c][idx];
+                }
+            }
+        }
+
+        struct Mode {
+            const char * name;
+            ConvMode conv;
+        };
+        for (auto mode : {Mode{"im2col  ", {false, false, false}},
+                          Mode{"winograd", {true, false, false}},
+                          Mode{"direct  ", {true, true, false}},
+                          Mode{"int8    ", {true, true, true}}}) {
+            // The direct mode needs AVX2 or AVX-512
+            if (mode.conv.direct && !mode.conv.int8
+                && DirectConv::get_isa() == DirectConv::NONE) {
+                continue;
+            }
+            Time start;
+            for (int loop = 0; loop < batches; loop++) {
+                forward_cpu(*weights, input, batch_size, mode.conv);
+            }
+            Time end;
+            myprintf("BLAS tower, %s, batch %2d: %d n/s\n",
+                     mode.name, batch_size,
+                     (int)((float)evals/((float)Time::timediff(start,end)/100.0)));
         }
-        linecount++;
     }
-    // 1 format id, 1 input layer (4 x weights), 14 ending weights,
-    // the rest are residuals, every residual has 8 x weight lines
-    auto residual_blocks = linecount - (1 + 4 + 14);
-    if (residual_blocks % 8 != 0) {
-        myprintf("\nInconsistent number of weights in the file.\n");
-        exit(EXIT_FAILURE);
+
+    // Accuracy of int8 on the positions of the game so far
+    auto positions = std::vector<GameState>{*state};
+    while (positions.size() < 16) {
+        auto previous = positions.back();
+        if (!previous.undo_move()) {
+            break;
+        }
+        positions.push_back(previous);
     }
-    residual_blocks /= 8;
-    myprintf("%d blocks\nTransferring weights to GPU...", residual_blocks);
+    auto calibration_states = std::vector<GameState*>{};
+    for (auto& position : positions) {
+        calibration_states.push_back(&position);
+    }
+    calibrate(calibration_states);
+#endif
+    return allocations_ok;
+}
 
-    // Re-read file and process
-    wtfile.clear();
-    wtfile.seekg(0, std::ios::beg);
+// Compare the int8 tower against fp32 on some positions. Reports the
+// KL divergence of the policy, the value error and the speed of both.
+void Network::calibrate(const std::vector<GameState*>& states) {
+#ifdef USE_BLAS
+    constexpr int BENCH_AMOUNT = 800;
+    const auto batch_size = states.size();
+    const auto weights = get_weights();
+    const int batches = (BENCH_AMOUNT + (batch_size - 1)) / batch_size;
+    const int evals = batches * batch_size;
+
+    auto input = aligned_vector(INPUT_CHANNELS * BOARD_SQUARE_SIZE * batch_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        NNPlanes planes;
+        gather_features(states[n], planes);
+        for (auto c = 0; c < INPUT_CHANNELS; c++) {
+            for (auto idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+                input[(c * batch_size + n) * BOARD_SQUARE_SIZE + idx] =
+                    (float)planes[c][idx];
+            }
+        }
+    }
+    // [0] is fp32, [1] is int8
+    std::array<aligned_vector, 2> policy;
+    std::array<aligned_vector, 2> winrate;
+    std::array<int, 2> nps;
+    for (auto int8 : {0, 1}) {
+        auto conv_mode = get_conv_mode();
+        conv_mode.int8 = int8;
+        Time start;
+        for (int loop = 1; loop < batches; loop++) {
+            forward_cpu(*weights, input, batch_size, conv_mode);
+        }
+        const auto& tower = forward_cpu(*weights, input, batch_size,
+                                        conv_mode);
+        Time end;
+        nps[int8] =
+            (int)((float)evals/((float)Time::timediff(start,end)/100.0));
+        forward_heads(*weights, tower, batch_size,
+                      policy[int8], winrate[int8]);
+    }
 
-    // Get the file format id out of the way
-    std::getline(wtfile, line);
+    auto sum_kl = 0.0;
+    auto max_kl = 0.0;
+    auto sum_error = 0.0;
+    auto max_error = 0.0;
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        auto kl = 0.0;
+        for (auto idx = 0; idx < BOARD_ACTION_N; idx++) {
+            const double p = policy[0][n * BOARD_ACTION_N + idx];
+            const double q = policy[1][n * BOARD_ACTION_N + idx];
+            if (p > 0.0) {
+                kl += p * std::log(p / std::max(q, 1e-10));
+            }
+        }
+        const auto error = std::fabs(double(winrate[0][n]) - winrate[1][n]);
+        sum_kl += kl;
+        max_kl = std::max(max_kl, kl);
+        sum_error += error;
+        max_error = std::max(max_error, error);
+    }
+    myprintf("int8 vs fp32 on %d positions: policy KL %.5f (max %.5f), "
+             "value error %.4f (max %.4f)\n",
+             int(batch_size), sum_kl / batch_size, max_kl,
+             sum_error / batch_size, max_error);
+    myprintf("fp32 tower: %d n/s, int8 tower: %d n/s\n", nps[0], nps[1]);
+#endif
+}
+
+// Fold the batchnorm layer that follows a convolution into its
+// weights and biases: w' = w / stddev, b' = (b - mean) / stddev
+static void fold_batchnorm(std::vector<float>& weights,
+                           std::vector<float>& biases,
+                           const std::vector<float>& means,
+                           const std::vector<float>& variances) {
+    constexpr float epsilon = 1e-5f;
+    const auto outputs = biases.size();
+    const auto filter_len = weights.size() / outputs;
+    assert(means.size() == outputs && variances.size() == outputs);
+
+    for (auto o = size_t{0}; o < outputs; o++) {
+        const auto scale_stddiv = 1.0f / std::sqrt(variances[o] + epsilon);
+        for (auto i = size_t{0}; i < filter_len; i++) {
+            weights[o * filter_len + i] *= scale_stddiv;
+        }
+        biases[o] = (biases[o] - means[o]) * scale_stddiv;
+    }
+}
 
+// Reads a weights file into a new NetworkWeights, nullptr if the file
+// can't be used. Everything but the OpenCL upload happens here.
+static std::shared_ptr<NetworkWeights> read_weights(const std::string& filename) {
+    myprintf("Loading %s...", filename.c_str());
+    auto tensors = Weights::Tensors{};
+    if (!Weights::load(filename, tensors)) {
+        return nullptr;
+    }
+    // 1 input layer (4 x weights), 14 ending weights, the rest are
+    // residuals, every residual has 8 x weights
+    if (tensors.size() < 4 + 14 || (tensors.size() - (4 + 14)) % 8 != 0) {
+        myprintf("\nInconsistent number of weights in the file.\n");
+        return nullptr;
+    }
+    auto residual_blocks = (tensors.size() - (4 + 14)) / 8;
+    // The convolution layer biases tell us the amount of channels in
+    // the residual layers. (Provided they're all equally large - that's
+    // not actually required!)
+    myprintf("%d channels...", tensors[1].size());
+    myprintf("%d blocks\n", residual_blocks);
+
+    auto net = std::make_shared<NetworkWeights>();
     auto plain_conv_layers = 1 + (residual_blocks * 2);
     auto plain_conv_wts = plain_conv_layers * 4;
-    linecount = 0;
-    while (std::getline(wtfile, line)) {
-        std::vector<float> weights;
-        float weight;
-        std::istringstream iss(line);
-        while (iss >> weight) {
-            weights.emplace_back(weight);
-        }
-        if (linecount < plain_conv_wts) {
-            if (linecount % 4 == 0) {
-                conv_weights.emplace_back(weights);
-            } else if (linecount % 4 == 1) {
-                conv_biases.emplace_back(weights);
-            } else if (linecount % 4 == 2) {
-                batchnorm_means.emplace_back(weights);
-            } else if (linecount % 4 == 3) {
-                batchnorm_variances.emplace_back(weights);
+    std::vector<std::vector<float>> batchnorm_means;
+    std::vector<std::vector<float>> batchnorm_variances;
+    std::vector<float> conv_pol_w, conv_pol_b, bn_pol_w1, bn_pol_w2;
+    std::vector<float> conv_val_w, conv_val_b, bn_val_w1, bn_val_w2;
+    for (auto i = size_t{0}; i < tensors.size(); i++) {
+        auto& weights = tensors[i];
+        if (i < plain_conv_wts) {
+            if (i % 4 == 0) {
+                net->conv_weights.emplace_back(std::move(weights));
+            } else if (i % 4 == 1) {
+                net->conv_biases.emplace_back(std::move(weights));
+            } else if (i % 4 == 2) {
+                batchnorm_means.emplace_back(std::move(weights));
+            } else if (i % 4 == 3) {
+                batchnorm_variances.emplace_back(std::move(weights));
             }
-        } else if (linecount == plain_conv_wts) {
+        } else if (i == plain_conv_wts) {
             conv_pol_w = std::move(weights);
-        } else if (linecount == plain_conv_wts + 1) {
+        } else if (i == plain_conv_wts + 1) {
             conv_pol_b = std::move(weights);
-        } else if (linecount == plain_conv_wts + 2) {
-            std::copy(begin(weights), end(weights), begin(bn_pol_w1));
-        } else if (linecount == plain_conv_wts + 3) {
-            std::copy(begin(weights), end(weights), begin(bn_pol_w2));
-        } else if (linecount == plain_conv_wts + 4) {
-            std::copy(begin(weights), end(weights), begin(ip_pol_w));
-        } else if (linecount == plain_conv_wts + 5) {
-            std::copy(begin(weights), end(weights), begin(ip_pol_b));
-        } else if (linecount == plain_conv_wts + 6) {
+        } else if (i == plain_conv_wts + 2) {
+            bn_pol_w1 = std::move(weights);
+        } else if (i == plain_conv_wts + 3) {
+            bn_pol_w2 = std::move(weights);
+        } else if (i == plain_conv_wts + 4) {
+            net->ip_pol_w = std::move(weights);
+        } else if (i == plain_conv_wts + 5) {
+            net->ip_pol_b = std::move(weights);
+        } else if (i == plain_conv_wts + 6) {
             conv_val_w = std::move(weights);
-        } else if (linecount == plain_conv_wts + 7) {
+        } else if (i == plain_conv_wts + 7) {
             conv_val_b = std::move(weights);
-        } else if (linecount == plain_conv_wts + 8) {
-            std::copy(begin(weights), end(weights), begin(bn_val_w1));
-        } else if (linecount == plain_conv_wts + 9) {
-            std::copy(begin(weights), end(weights), begin(bn_val_w2));
-        } else if (linecount == plain_conv_wts + 10) {
-            std::copy(begin(weights), end(weights), begin(ip1_val_w));
-        } else if (linecount == plain_conv_wts + 11) {
-            std::copy(begin(weights), end(weights), begin(ip1_val_b));
-        } else if (linecount == plain_conv_wts + 12) {
-            std::copy(begin(weights), end(weights), begin(ip2_val_w));
-        } else if (linecount == plain_conv_wts + 13) {
-            std::copy(begin(weights), end(weights), begin(ip2_val_b));
+        } else if (i == plain_conv_wts + 8) {
+            bn_val_w1 = std::move(weights);
+        } else if (i == plain_conv_wts + 9) {
+            bn_val_w2 = std::move(weights);
+        } else if (i == plain_conv_wts + 10) {
+            net->ip1_val_w = std::move(weights);
+        } else if (i == plain_conv_wts + 11) {
+            net->ip1_val_b = std::move(weights);
+        } else if (i == plain_conv_wts + 12) {
+            net->ip2_val_w = std::move(weights);
+        } else if (i == plain_conv_wts + 13) {
+            net->ip2_val_b = std::move(weights);
+        }
+    }
+
+    // The heads are sized for the board, the value head can be of
+    // any width
+    const auto value_fc = net->ip1_val_b.size();
+    if (net->ip_pol_w.size() != 2 * BOARD_SQUARE_SIZE * BOARD_ACTION_N
+        || net->ip_pol_b.size() != BOARD_ACTION_N
+        || value_fc == 0
+        || net->ip1_val_w.size() != BOARD_SQUARE_SIZE * value_fc
+        || net->ip2_val_w.size() != value_fc
+        || net->ip2_val_b.size() != 1) {
+        myprintf("The heads in the weights file don't fit a %dx%d board.\n",
+                 BOARD_SIZE, BOARD_SIZE);
+        return nullptr;
+    }
+    // Everything below indexes the tensors by these sizes, so a
+    // truncated or mismatched file has to stop here. Every layer of
+    // the tower has the width of the input convolution.
+    const auto channels = net->conv_biases[0].size();
+    if (channels == 0) {
+        myprintf("The weights file has an empty input convolution.\n");
+        return nullptr;
+    }
+    for (auto i = size_t{0}; i < net->conv_weights.size(); i++) {
+        const auto inputs = (i == 0 ? size_t{Network::INPUT_CHANNELS} : channels);
+        if (net->conv_biases[i].size() != channels
+            || net->conv_weights[i].size() != channels * inputs * 9
+            || batchnorm_means[i].size() != channels
+            || batchnorm_variances[i].size() != channels) {
+            myprintf("Convolution %d in the weights file doesn't fit "
+                     "%d inputs and %d outputs.\n",
+                     int(i), int(inputs), int(channels));
+            return nullptr;
+        }
+    }
+    if (conv_pol_w.size() != 2 * channels || conv_pol_b.size() != 2
+        || bn_pol_w1.size() != 2 || bn_pol_w2.size() != 2
+        || conv_val_w.size() != channels || conv_val_b.size() != 1
+        || bn_val_w1.size() != 1 || bn_val_w2.size() != 1) {
+        myprintf("The head convolutions in the weights file don't fit "
+                 "%d channels.\n", int(channels));
+        return nullptr;
+    }
+    net->cache_salt = Random::get_Rng()();
+
+    // Every convolution is followed by a batchnorm layer, so inference
+    // only needs the fused conv + bias (+ residual) + ReLU.
+    for (auto i = size_t{0}; i < net->conv_weights.size(); i++) {
+        fold_batchnorm(net->conv_weights[i], net->conv_biases[i],
+                       batchnorm_means[i], batchnorm_variances[i]);
+    }
+    fold_batchnorm(conv_pol_w, conv_pol_b, bn_pol_w1, bn_pol_w2);
+    fold_batchnorm(conv_val_w, conv_val_b, bn_val_w1, bn_val_w2);
+
+    // Both heads read the tower output in a single 1x1 convolution
+    net->head_conv_w = std::move(conv_pol_w);
+    net->head_conv_w.insert(end(net->head_conv_w),
+                            begin(conv_val_w), end(conv_val_w));
+    net->head_conv_b = std::move(conv_pol_b);
+    net->head_conv_b.insert(end(net->head_conv_b),
+                            begin(conv_val_b), end(conv_val_b));
+    assert(net->head_conv_b.size() == Network::HEAD_PLANES);
+
+    // Pre-transform the 3x3 filters for the BLAS Winograd path
+    for (auto i = size_t{0}; i < net->conv_weights.size(); i++) {
+        auto outputs = net->conv_biases[i].size();
+        auto channels = net->conv_weights[i].size() / (outputs * 9);
+        net->conv_weights_winograd.emplace_back(
+            winograd_transform_f(net->conv_weights[i], outputs, channels));
+        // The input layer has too few channels to be worth it
+        if (can_quantize(channels, outputs)) {
+            net->conv_weights_int8.emplace_back(
+                quantize_filter(net->conv_weights[i], outputs));
+        } else {
+            net->conv_weights_int8.emplace_back();
         }
-        linecount++;
-    }
-    wtfile.close();
-
-    // input
-    size_t weight_index = 0;
-    opencl_net.push_convolve(3, conv_weights[weight_index],
-                                conv_biases[weight_index]);
-    opencl_net.push_batchnorm(BOARD_SQUARE_SIZE, batchnorm_means[weight_index],
-                                   batchnorm_variances[weight_index]);
-    weight_index++;
-
-    // residual blocks
-    for (auto i = size_t{0}; i < residual_blocks; i++) {
-        opencl_net.push_residual(3, conv_weights[weight_index],
-                                    conv_biases[weight_index],
-                                    batchnorm_means[weight_index],
-                                    batchnorm_variances[weight_index],
-                                    conv_weights[weight_index + 1],
-                                    conv_biases[weight_index + 1],
-                                    batchnorm_means[weight_index + 1],
-                                    batchnorm_variances[weight_index + 1]);
-        weight_index += 2;
+    }
+    return net;
+}
+
+#ifdef USE_OPENCL
+// False if a device can't take the weights, for example when it runs
+// out of memory. The devices are then left as they were.
+static bool upload_weights(NetworkWeights& net) {
+    myprintf("Transferring weights to GPU...");
+    try {
+        net.opencl = opencl.create_replicas();
+        // input
+        size_t weight_index = 0;
+        net.opencl->push_convolve(3, net.conv_weights[weight_index],
+                                  net.conv_biases[weight_index]);
+        weight_index++;
+
+        // residual blocks
+        while (weight_index < net.conv_weights.size()) {
+            net.opencl->push_residual(3, net.conv_weights[weight_index],
+                                      net.conv_biases[weight_index],
+                                      net.conv_weights[weight_index + 1],
+                                      net.conv_biases[weight_index + 1]);
+            weight_index += 2;
+        }
+
+        net.opencl->push_heads(net.head_conv_w, net.head_conv_b,
+                               net.ip_pol_w, net.ip_pol_b,
+                               net.ip1_val_w, net.ip1_val_b,
+                               net.ip2_val_w, net.ip2_val_b);
+    } catch (const cl::Error& e) {
+        myprintf("failed\nError in upload_weights: %s: %d\n",
+                 e.what(), e.err());
+        net.opencl.reset();
+        return false;
     }
     myprintf("done\n");
+    return true;
+}
+#endif
+
+bool Network::set_weights(std::shared_ptr<NetworkWeights> weights) {
+#ifdef USE_OPENCL
+    if (!cfg_cpu_only && !upload_weights(*weights)) {
+        return false;
+    }
+#endif
+    std::atomic_store(&m_weights,
+                      std::shared_ptr<const NetworkWeights>(std::move(weights)));
+    return true;
+}
+
+bool Network::load_weights(const std::string& filename) {
+    auto weights = read_weights(filename);
+    return weights && set_weights(std::move(weights));
+}
+
+int Network::get_queue_workers(size_t devices) {
+    // Funnel the search threads through a few batched evaluators.
+    // One thread keeps an OpenCL device busy. A BLAS worker takes a
+    // core, so there are only as many as the searchers can fill.
+    if (cfg_nn_workers > 0) {
+        return cfg_nn_workers;
+    }
+    if (devices > 0) {
+        return static_cast<int>(devices);
+    }
+    return std::max(1, cfg_num_threads / cfg_nn_batch_size);
+}
+
+int Network::get_queue_batch_size(size_t devices) {
+    // The OpenCL kernels are tuned for this size
+    return std::max(1, std::min(cfg_nn_batch_size,
+                                cfg_num_threads / get_queue_workers(devices)));
+}
+
+void Network::initialize(void) {
+    auto weights = read_weights(cfg_weightsfile);
+    if (!weights) {
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef USE_OPENCL
+    if (cfg_cpu_only) {
+        myprintf("Using the BLAS backend, OpenCL disabled\n");
+    } else {
+        myprintf("Initializing OpenCL\n");
+        opencl.initialize(weights->conv_biases[0].size());
+    }
 #endif
+    if (!get_Network().set_weights(std::move(weights))) {
+        exit(EXIT_FAILURE);
+    }
+
 #ifdef USE_BLAS
 #ifndef __APPLE__
 #ifdef USE_OPENBLAS
@@ -254,27 +641,54 @@ void Network::initialize(void) {
     myprintf("BLAS core: MKL %s\n", Version.Processor);
 #endif
 #endif
+    myprintf("Direct convolutions: %s\n", DirectConv::get_isa_name());
 #endif
+
+    NNCache::get_NNCache().resize(cfg_nn_cache_size);
+
+    auto devices = size_t{0};
+#ifdef USE_OPENCL
+    if (!cfg_cpu_only) {
+        devices = opencl.get_device_count();
+    }
+#endif
+    const auto workers = get_queue_workers(devices);
+    const auto batch_size = get_queue_batch_size(devices);
+    // Batches of 1 gain nothing from the queue but a thread handoff,
+    // the searchers evaluate on their own threads then
+    if (batch_size > 1) {
+        NNQueue::get_NNQueue().initialize(workers, batch_size,
+                                          cfg_nn_batch_wait_us);
+    } else {
+        myprintf("Evaluation queue off, batches of 1\n");
+    }
 }
 
 #ifdef USE_BLAS
-template<unsigned int filter_size,
-         unsigned int outputs>
-void convolve(const std::vector<float>& input,
+// Activations are laid out as [channels][batch_size][BOARD_SQUARE_SIZE],
+// so every layer is a single GEMM over the whole batch.
+// The GEMM is followed by bias + (optional) residual eltwise add + ReLU.
+template<unsigned int filter_size>
+void convolve(size_t outputs,
+              size_t batch_size,
+              const aligned_vector& input,
               const std::vector<float>& weights,
               const std::vector<float>& biases,
-              std::vector<float>& output) {
+              aligned_vector& output,
+              const float * eltwise = nullptr) {
     // fixed for BOARD_SIZE*BOARD_SIZE
     constexpr unsigned int width = BOARD_SIZE;
     constexpr unsigned int height = BOARD_SIZE;
-    constexpr unsigned int spatial_out = width * height;
     constexpr unsigned int filter_len = filter_size * filter_size;
+    const unsigned int spatial_out = width * height * batch_size;
 
-    auto channels = int(weights.size() / (biases.size() * filter_len));
+    auto channels = int(weights.size() / (outputs * filter_len));
     unsigned int filter_dim = filter_len * channels;
+    assert(outputs * spatial_out <= output.size());
 
-    std::vector<float> col(filter_dim * width * height);
-    im2col<filter_size>(channels, input, col);
+    auto& col = Workspace::get_thread_buffers().col;
+    col.resize(filter_dim * spatial_out);
+    im2col<filter_size>(channels, batch_size, input, col);
 
     // Weight shape (output, input, filter_size, filter_size)
     // 96 22 5 5
@@ -295,63 +709,222 @@ void convolve(const std::vector<float>& input,
                 &col[0], spatial_out,
                 0.0f, &output[0], spatial_out);
 
+    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
+                                       val : 0.0f; };
+
     for (unsigned int o = 0; o < outputs; o++) {
-        for (unsigned int b = 0; b < spatial_out; b++) {
-            output[(o * spatial_out) + b] =
-                biases[o] + output[(o * spatial_out) + b];
+        float * arr = &output[o * spatial_out];
+        if (eltwise == nullptr) {
+            for (unsigned int b = 0; b < spatial_out; b++) {
+                arr[b] = lambda_ReLU(biases[o] + arr[b]);
+            }
+        } else {
+            float const * res = &eltwise[o * spatial_out];
+            for (unsigned int b = 0; b < spatial_out; b++) {
+                arr[b] = lambda_ReLU(res[b] + biases[o] + arr[b]);
+            }
         }
     }
 }
 
-template<unsigned int inputs,
-         unsigned int outputs,
-         size_t W, size_t B>
-void innerproduct(const std::vector<float>& input,
-                  const std::array<float, W>& weights,
-                  const std::array<float, B>& biases,
-                  std::vector<float>& output) {
-    assert(B == outputs);
-
-    cblas_sgemv(CblasRowMajor, CblasNoTrans,
-                // M     K
-                outputs, inputs,
-                1.0f, &weights[0], inputs,
-                &input[0], 1,
-                0.0f, &output[0], 1);
+void winograd_convolve3(size_t outputs,
+                        size_t batch_size,
+                        const aligned_vector& input,
+                        const std::vector<float>& U,
+                        const std::vector<float>& biases,
+                        aligned_vector& output,
+                        const float * eltwise) {
+    const int channels = U.size() / (WINOGRAD_TILE * outputs);
+    const int tiles = batch_size * WINOGRAD_P;
+
+    auto& buffers = Workspace::get_thread_buffers();
+    auto& V = buffers.V;
+    auto& M = buffers.M;
+    V.resize(WINOGRAD_TILE * channels * tiles);
+    M.resize(WINOGRAD_TILE * outputs * tiles);
+
+    winograd_transform_in(input, V, channels, batch_size);
+
+    // One GEMM per point of the 6x6 tile:
+    // M[b][outputs, tiles] = U[b][outputs, channels] x V[b][channels, tiles]
+    for (auto b = 0; b < WINOGRAD_TILE; b++) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    // M        N      K
+                    outputs, tiles, channels,
+                    1.0f, &U[b * outputs * channels], channels,
+                    &V[b * channels * tiles], tiles,
+                    0.0f, &M[b * outputs * tiles], tiles);
+    }
 
-    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
-                                       val : 0.0f; };
+    winograd_transform_out(M, biases, eltwise, output, outputs, batch_size);
+}
 
-    for (unsigned int o = 0; o < outputs; o++) {
-        float val = biases[o] + output[o];
-        if (outputs == 256) {
-            val = lambda_ReLU(val);
+// 3x3 convolution + (optional) residual + ReLU of tower layer 'layer'
+void convolve3(const NetworkWeights& weights,
+               size_t layer,
+               size_t batch_size,
+               const Network::ConvMode& mode,
+               const aligned_vector& input,
+               aligned_vector& output,
+               const float * eltwise = nullptr) {
+    const auto outputs = weights.conv_biases[layer].size();
+    if (mode.int8 && weights.conv_weights_int8[layer].outputs) {
+        auto& buffers = Workspace::get_thread_buffers();
+        quantized_convolve3(weights.conv_weights_int8[layer], batch_size,
+                            input, weights.conv_biases[layer], output, eltwise,
+                            buffers.qinput, buffers.qscales);
+    } else if (mode.direct && DirectConv::can_convolve3(outputs)) {
+        DirectConv::convolve3(outputs, batch_size, input,
+                              weights.conv_weights[layer],
+                              weights.conv_biases[layer], output, eltwise);
+    } else if (mode.winograd) {
+        winograd_convolve3(outputs, batch_size, input,
+                           weights.conv_weights_winograd[layer],
+                           weights.conv_biases[layer], output, eltwise);
+    } else {
+        convolve<3>(outputs, batch_size, input,
+                    weights.conv_weights[layer], weights.conv_biases[layer],
+                    output, eltwise);
+    }
+}
+
+// 1x1 convolution + ReLU of the heads
+void convolve1(size_t outputs,
+               size_t batch_size,
+               const aligned_vector& input,
+               const std::vector<float>& weights,
+               const std::vector<float>& biases,
+               aligned_vector& output) {
+    if (cfg_direct_conv && DirectConv::can_convolve1()) {
+        DirectConv::convolve1(outputs, batch_size, input,
+                              weights, biases, output);
+    } else {
+        convolve<1>(outputs, batch_size, input, weights, biases, output);
+    }
+}
+
+const aligned_vector& Network::forward_cpu(const NetworkWeights& weights,
+                                           const aligned_vector& input,
+                                           size_t batch_size,
+                                           const ConvMode& mode) {
+    // Input convolution
+    constexpr int width = BOARD_SIZE;
+    constexpr int height = BOARD_SIZE;
+    const int spatial = width * height * batch_size;
+    // Calculate output channels
+    const auto output_channels = weights.conv_biases[0].size();
+    // Assumes that residual blocks are identical and have same
+    // number of inputs and outputs
+    auto& buffers = Workspace::get_thread_buffers();
+    auto& conv_out = buffers.conv_out;
+    auto& conv_in = buffers.conv_in;
+    auto& res = buffers.res;
+    conv_out.resize(output_channels * spatial);
+    conv_in.resize(output_channels * spatial);
+    res.resize(output_channels * spatial);
+    convolve3(weights, 0, batch_size, mode, input, conv_out);
+
+    // Residual tower
+    for (auto i = size_t{1}; i < weights.conv_weights.size(); i += 2) {
+        // conv_out holds the block input, which is added back
+        // by the second convolution
+        std::swap(conv_out, res);
+        convolve3(weights, i, batch_size, mode, res, conv_in);
+        convolve3(weights, i + 1, batch_size, mode, conv_in, conv_out,
+                  res.data());
+    }
+    return conv_out;
+}
+
+void Network::forward_heads(const NetworkWeights& weights,
+                            const aligned_vector& tower_output,
+                            size_t batch_size,
+                            aligned_vector& policy,
+                            aligned_vector& winrate) {
+    constexpr int width = BOARD_SIZE;
+    constexpr int height = BOARD_SIZE;
+    constexpr int spatial = width * height;
+    auto& buffers = Workspace::get_thread_buffers();
+    auto& head_data = buffers.head_data;
+    auto& policy_out = buffers.policy_out;
+    auto& value_fc = buffers.value_fc;
+    head_data.resize(HEAD_PLANES * spatial * batch_size);
+    policy_out.resize(BOARD_ACTION_N * batch_size);
+    const auto value_channels = int(weights.ip1_val_b.size());
+    value_fc.resize(value_channels * batch_size);
+
+    // [HEAD_PLANES][batch][spatial], a single pass over the tower output
+    convolve1(HEAD_PLANES, batch_size, tower_output,
+              weights.head_conv_w, weights.head_conv_b, head_data);
+
+    // Policy: every plane is a [batch][spatial] matrix, so the inner
+    // product is one GEMM per plane against its columns of ip_pol_w
+    for (auto c = 0; c < 2; c++) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                    // M          N               K
+                    batch_size, BOARD_ACTION_N, spatial,
+                    1.0f, &head_data[c * batch_size * spatial], spatial,
+                    &weights.ip_pol_w[c * spatial], 2 * spatial,
+                    c == 0 ? 0.0f : 1.0f, &policy_out[0], BOARD_ACTION_N);
+    }
+    policy.resize(BOARD_ACTION_N * batch_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        auto logits = &policy_out[n * BOARD_ACTION_N];
+        for (auto idx = 0; idx < BOARD_ACTION_N; idx++) {
+            logits[idx] += weights.ip_pol_b[idx];
         }
-        output[o] = val;
+        softmax(logits, &policy[n * BOARD_ACTION_N],
+                BOARD_ACTION_N, cfg_softmax_temp);
+    }
+
+    // Value: FC + ReLU, then the last FC, tanh and rescale per position
+    const float * value_data = &head_data[2 * batch_size * spatial];
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                // M          N               K
+                batch_size, value_channels, spatial,
+                1.0f, value_data, spatial,
+                &weights.ip1_val_w[0], spatial,
+                0.0f, &value_fc[0], value_channels);
+    winrate.resize(batch_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        auto fc = &value_fc[n * value_channels];
+        auto sum = weights.ip2_val_b[0];
+        for (auto i = 0; i < value_channels; i++) {
+            auto val = std::max(0.0f, fc[i] + weights.ip1_val_b[i]);
+            sum += val * weights.ip2_val_w[i];
+        }
+        winrate[n] = (1.0f + std::tanh(sum)) / 2.0f;
     }
 }
+#endif
 
-template<unsigned int channels,
-         unsigned int spatial_size>
-void batchnorm(const std::vector<float>& input,
-               const std::array<float, channels>& means,
-               const std::array<float, channels>& variances,
-               std::vector<float>& output)
-{
-    constexpr float epsilon = 1e-5f;
+#ifdef USE_OPENCL_SELFCHECK
+static float relative_difference(float a, float b) {
+    // Handle sign difference
+    if (((a < 0) && (b > 0)) || ((a > 0) && (b < 0))) {
+        return std::numeric_limits<float>::max();
+    }
 
-    auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
-                                       val : 0.0f; };
+    // Handle zeros
+    constexpr float small_number = 1e-3f;
+    auto fa = std::max(std::fabs(a), small_number);
+    auto fb = std::max(std::fabs(b), small_number);
 
-    for (unsigned int c = 0; c < channels; ++c) {
-        float mean = means[c];
-        float variance = variances[c] + epsilon;
-        float scale_stddiv = 1.0f / std::sqrt(variance);
+    return std::fabs(fa - fb) / std::min(fa, fb);
+}
 
-        float * out = &output[c * spatial_size];
-        float const * in  = &input[c * spatial_size];
-        for (unsigned int b = 0; b < spatial_size; b++) {
-            out[b] = lambda_ReLU(scale_stddiv * (in[b] - mean));
+void Network::compare_net_outputs(const aligned_vector& data,
+                                  const aligned_vector& ref) {
+    // We accept an error up to 5%, but output values
+    // smaller than 1/1000th are "rounded up" for the comparison.
+    constexpr float relative_error = 5e-2f;
+    for (auto idx = size_t{0}; idx < data.size(); ++idx) {
+        auto err = relative_difference(data[idx], ref[idx]);
+        if (err > relative_error) {
+            myprintf("Error in OpenCL calculation: expected %f got %f "
+                     "(error=%f%%)\n", ref[idx], data[idx], err * 100.0);
+            myprintf("Update your OpenCL drivers or use --cpu-only.\n");
+            throw std::runtime_error("OpenCL self-check mismatch.");
         }
     }
 }
@@ -361,20 +934,25 @@ void Network::softmax(const std::vector<float>& input,
                       std::vector<float>& output,
                       float temperature) {
     assert(&input != &output);
+    assert(input.size() >= output.size());
+    softmax(input.data(), output.data(), output.size(), temperature);
+}
 
-    float alpha = *std::max_element(input.begin(),
-                                    input.begin() + output.size());
+void Network::softmax(const float * input, float * output, size_t size,
+                      float temperature) {
+    assert(input != output);
+
+    float alpha = *std::max_element(input, input + size);
     alpha /= temperature;
 
     float denom = 0.0f;
-    std::vector<float> helper(output.size());
-    for (size_t i = 0; i < output.size(); i++) {
+    for (size_t i = 0; i < size; i++) {
         float val  = std::exp((input[i]/temperature) - alpha);
-        helper[i]  = val;
+        output[i]  = val;
         denom     += val;
     }
-    for (size_t i = 0; i < output.size(); i++) {
-        output[i] = helper[i] / denom;
+    for (size_t i = 0; i < size; i++) {
+        output[i] /= denom;
     }
 }
 
@@ -385,91 +963,218 @@ Network::Netresult Network::get_scored_moves(
         return result;
     }
 
-    NNPlanes planes;
-    gather_features(state, planes);
+    // Any symmetry will do, so a transposition or a mirrored
+    // position that was evaluated before can be reused.
+    auto& nncache = NNCache::get_NNCache();
+    auto cache_key = NNCache::Key{};
+    if (ensemble == RANDOM_ROTATION) {
+        cache_key = NNCache::get_key(state);
+        cache_key.hash ^= get_weights()->cache_salt;
+        if (nncache.lookup(state, cache_key, result)) {
+            return result;
+        }
+    }
+
+    // The 8 symmetries of an AVERAGE ensemble are a full batch of
+    // their own, so they run on this thread in a single forward pass
+    if (ensemble == AVERAGE) {
+        return get_scored_moves_batch({state}, ensemble, rotation)[0];
+    }
 
-    if (ensemble == DIRECT) {
-        assert(rotation >= 0 && rotation <= 7);
-        result = get_scored_moves_internal(state, planes, rotation);
+    // Let the evaluation threads batch us up with the other searchers
+    auto& nnqueue = NNQueue::get_NNQueue();
+    if (nnqueue.is_running()) {
+        result = nnqueue.post(*this, state, ensemble, rotation).get();
     } else {
-        assert(ensemble == RANDOM_ROTATION);
-        assert(rotation == -1);
-        int rand_rot = Random::get_Rng()->randfix<8>();
-        result = get_scored_moves_internal(state, planes, rand_rot);
+        result = get_scored_moves_batch({state}, ensemble, rotation)[0];
     }
 
+    if (ensemble == RANDOM_ROTATION) {
+        nncache.insert(state, cache_key, result);
+    }
     return result;
 }
 
-Network::Netresult Network::get_scored_moves_internal(
-    GameState * state, NNPlanes & planes, int rotation) {
-    assert(rotation >= 0 && rotation <= 7);
+std::vector<Network::Netresult> Network::get_scored_moves_batch(
+    const std::vector<GameState*>& states, Ensemble ensemble, int rotation) {
+    if (ensemble == AVERAGE) {
+        // Every position is evaluated under each symmetry
+        assert(rotation == -1);
+        constexpr auto symmetries = size_t{Symmetry::NUM_SYMMETRIES};
+        auto batch_states = std::vector<GameState*>{};
+        auto batch_planes = std::vector<NNPlanes>(states.size() * symmetries);
+        auto rotations = std::vector<int>{};
+        for (auto n = size_t{0}; n < states.size(); n++) {
+            assert(states[n]->board.get_boardsize() == BOARD_SIZE);
+            gather_features(states[n], batch_planes[n * symmetries]);
+            for (auto s = size_t{0}; s < symmetries; s++) {
+                batch_planes[n * symmetries + s] = batch_planes[n * symmetries];
+                batch_states.emplace_back(states[n]);
+                rotations.emplace_back(s);
+            }
+        }
+        auto results = std::vector<Netresult>{};
+        get_scored_moves_internal(batch_states, batch_planes, rotations,
+                                  results);
+        auto averaged = std::vector<Netresult>{};
+        for (auto n = size_t{0}; n < states.size(); n++) {
+            averaged.emplace_back(
+                average_results(&results[n * symmetries], symmetries));
+        }
+        return averaged;
+    }
+
+    auto batch_planes = std::vector<NNPlanes>(states.size());
+    auto rotations = std::vector<int>(states.size());
+
+    for (auto n = size_t{0}; n < states.size(); n++) {
+        assert(states[n]->board.get_boardsize() == BOARD_SIZE);
+        gather_features(states[n], batch_planes[n]);
+
+        if (ensemble == DIRECT) {
+            assert(rotation >= 0 && rotation < Symmetry::NUM_SYMMETRIES);
+            rotations[n] = rotation;
+        } else {
+            assert(ensemble == RANDOM_ROTATION);
+            assert(rotation == -1);
+            rotations[n] = Random::get_Rng().randfix<Symmetry::NUM_SYMMETRIES>();
+        }
+    }
+
+    auto results = std::vector<Netresult>{};
+    get_scored_moves_internal(states, batch_planes, rotations, results);
+    return results;
+}
+
+Network::Netresult Network::average_results(const Netresult * results,
+                                            size_t count) {
+    assert(count > 0);
+    auto averaged = results[0];
+    auto& moves = averaged.first;
+    assert(moves.back().second == FastBoard::PASS);
+
+    // Every evaluation scores the same moves, but in its own order
+    std::array<size_t, FastBoard::MAXSQ> index;
+    for (auto i = size_t{0}; i + 1 < moves.size(); i++) {
+        index[moves[i].second] = i;
+    }
+    for (auto r = size_t{1}; r < count; r++) {
+        assert(results[r].first.size() == moves.size());
+        for (const auto& node : results[r].first) {
+            auto i = moves.size() - 1;
+            if (node.second != FastBoard::PASS) {
+                i = index[node.second];
+            }
+            moves[i].first += node.first;
+        }
+        averaged.second += results[r].second;
+    }
+    for (auto& node : moves) {
+        node.first /= count;
+    }
+    averaged.second /= count;
+
+    return averaged;
+}
+
+void Network::get_scored_moves_internal(
+    const std::vector<GameState*>& states,
+    std::vector<NNPlanes>& batch_planes,
+    const std::vector<int>& rotations,
+    std::vector<Netresult>& results) {
     constexpr int channels = INPUT_CHANNELS;
-    assert(channels == planes.size());
     constexpr int width = BOARD_SIZE;
     constexpr int height = BOARD_SIZE;
-    constexpr int max_channels = MAX_CHANNELS;
-    std::vector<float> input_data(max_channels * width * height);
-    std::vector<float> output_data(max_channels * width * height);
-    std::vector<float> policy_data_1(2 * width * height);
-    std::vector<float> policy_data_2(2 * width * height);
-    std::vector<float> value_data_1(1 * width * height);
-    std::vector<float> value_data_2(1 * width * height);
-    std::vector<float> policy_out((width * height) + 1);
-    std::vector<float> softmax_data((width * height) + 1);
-    std::vector<float> winrate_data(256);
-    std::vector<float> winrate_out(1);
-    for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < height; ++h) {
-            for (int w = 0; w < width; ++w) {
-                auto rot_idx = rotate_nn_idx(h * BOARD_SIZE + w, rotation);
-                input_data[(c * height + h) * width + w] =
-                    (float)planes[c][rot_idx];
-            }
+    const auto batch_size = states.size();
+    assert(batch_size == batch_planes.size());
+    assert(batch_size == rotations.size());
+    auto& buffers = Workspace::get_thread_buffers();
+    auto& input_masks = buffers.input_masks;
+    auto& input_data = buffers.input;
+    auto& outputs = buffers.policy;
+    auto& winrates = buffers.winrate;
+    // The whole batch uses the same network, even if it is replaced now
+    const auto weights = get_weights();
+    input_masks.resize(batch_size * channels);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        const auto& planes = batch_planes[n];
+        const auto rotation = rotations[n];
+        assert(rotation >= 0 && rotation < Symmetry::NUM_SYMMETRIES);
+        assert(channels == planes.size());
+        for (int c = 0; c < channels; ++c) {
+            input_masks[n * channels + c] =
+                Symmetry::transform_mask(planes[c].to_ullong(), rotation);
         }
     }
+    // The OpenCL backend uploads the masks and expands them on the device
+    auto expand_input = [&]() {
+        input_data.resize(channels * width * height * batch_size);
+        for (auto n = size_t{0}; n < batch_size; n++) {
+            for (int c = 0; c < channels; ++c) {
+                auto plane = &input_data[(c * batch_size + n) * width * height];
+                auto mask = input_masks[n * channels + c];
+                for (int idx = 0; idx < width * height; ++idx) {
+                    plane[idx] = float((mask >> idx) & 1);
+                }
+            }
+        }
+    };
 #ifdef USE_OPENCL
-    opencl_net.forward(input_data, output_data);
-    // Get the moves
-    convolve<1, 2>(output_data, conv_pol_w, conv_pol_b, policy_data_1);
-    batchnorm<2, BOARD_SQUARE_SIZE>(policy_data_1, bn_pol_w1, bn_pol_w2, policy_data_2);
-    innerproduct<2*BOARD_SQUARE_SIZE, BOARD_ACTION_N>(policy_data_2, ip_pol_w, ip_pol_b, policy_out);
-    softmax(policy_out, softmax_data, cfg_softmax_temp);
-    std::vector<float>& outputs = softmax_data;
-
-    // Now get the score
-    convolve<1, 1>(output_data, conv_val_w, conv_val_b, value_data_1);
-    batchnorm<1, BOARD_SQUARE_SIZE>(value_data_1, bn_val_w1, bn_val_w2, value_data_2);
-    innerproduct<BOARD_SQUARE_SIZE, 256>(value_data_2, ip1_val_w, ip1_val_b, winrate_data);
-    innerproduct<256, 1>(winrate_data, ip2_val_w, ip2_val_b, winrate_out);
-
-    // Sigmoid
-    float winrate_sig = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
-#elif defined(USE_BLAS) && !defined(USE_OPENCL)
-#error "Not implemented"
-    // Not implemented yet - not very useful unless you have some
-    // sort of Xeon Phi
-    softmax(output_data, softmax_data, cfg_softmax_temp);
-    // Move scores
-    std::vector<float>& outputs = softmax_data;
+    if (cfg_cpu_only) {
+        expand_input();
+        const auto& tower = forward_cpu(*weights, input_data, batch_size,
+                                        get_conv_mode());
+        forward_heads(*weights, tower, batch_size, outputs, winrates);
+    } else {
+        // The heads run on the device too
+        opencl.forward(*weights->opencl, input_masks, outputs, winrates,
+                       batch_size);
+    }
+#elif defined(USE_BLAS)
+    expand_input();
+    const auto& tower = forward_cpu(*weights, input_data, batch_size,
+                                    get_conv_mode());
+    forward_heads(*weights, tower, batch_size, outputs, winrates);
 #endif
-    std::vector<scored_node> result;
-    for (size_t idx = 0; idx < outputs.size(); idx++) {
-        if (idx < BOARD_SIZE*BOARD_SIZE) {
-            auto val = outputs[idx];
-            auto rot_idx = rotate_nn_idx(idx, rotation);
-            int x = rot_idx % BOARD_SIZE;
-            int y = rot_idx / BOARD_SIZE;
-            int rot_vtx = state->board.get_vertex(x, y);
-            if (state->board.get_square(rot_vtx) == FastBoard::EMPTY) {
-                result.emplace_back(val, rot_vtx);
+#ifdef USE_OPENCL_SELFCHECK
+    // Both backends are available, so check the OpenCL driver
+    // against the BLAS reference every now and then.
+    if (!cfg_cpu_only
+        && Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0) {
+        expand_input();
+        auto cpu_outputs = aligned_vector{};
+        auto cpu_winrates = aligned_vector{};
+        const auto& cpu_tower = forward_cpu(*weights, input_data, batch_size,
+                                            get_conv_mode());
+        forward_heads(*weights, cpu_tower, batch_size,
+                      cpu_outputs, cpu_winrates);
+        compare_net_outputs(outputs, cpu_outputs);
+        compare_net_outputs(winrates, cpu_winrates);
+    }
+#endif
+    results.resize(batch_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        const auto state = states[n];
+        const auto rotation = rotations[n];
+        const auto board_outputs = &outputs[n * BOARD_ACTION_N];
+        auto& result = results[n].first;
+        result.clear();
+        for (size_t idx = 0; idx < BOARD_ACTION_N; idx++) {
+            if (idx < BOARD_SIZE*BOARD_SIZE) {
+                auto val = board_outputs[idx];
+                auto rot_idx = Symmetry::transform_index(idx, rotation);
+                int x = rot_idx % BOARD_SIZE;
+                int y = rot_idx / BOARD_SIZE;
+                int rot_vtx = state->board.get_vertex(x, y);
+                if (state->board.get_square(rot_vtx) == FastBoard::EMPTY) {
+                    result.emplace_back(val, rot_vtx);
+                }
+            } else {
+                result.emplace_back(board_outputs[idx], FastBoard::PASS);
             }
-        } else {
-            result.emplace_back(outputs[idx], FastBoard::PASS);
         }
+        results[n].second = winrates[n];
     }
-
-    return std::make_pair(result, winrate_sig);
 }
 
 void Network::show_heatmap(FastState * state, Netresult& result, bool topmoves) {
@@ -525,82 +1230,33 @@ void Network::show_heatmap(FastState * state, Netresult& result, bool topmoves)
     }
 }
 
-void Network::gather_features(GameState * state, NNPlanes & planes) {
-    planes.resize(18);
-    constexpr size_t our_offset   = 0;
-    constexpr size_t their_offset = 8;
-    BoardPlane& black_to_move  = planes[16];
-    BoardPlane& white_to_move  = planes[17];
-
-    int to_move = state->get_to_move();
-    bool whites_move = to_move == FastBoard::WHITE;
-    if (whites_move) {
-        white_to_move.set();
-    } else {
-        black_to_move.set();
-    }
-
-    // Go back in time, fill history boards
-    size_t backtracks = 0;
-    for (int h = 0; h < 8; h++) {
-        // collect white, black occupation planes
-        for (int j = 0; j < BOARD_SIZE; j++) {
-            for(int i = 0; i < BOARD_SIZE; i++) {
-                int vtx = state->board.get_vertex(i, j);
-                FastBoard::square_t color =
-                    state->board.get_square(vtx);
-                int idx = j * BOARD_SIZE + i;
-                if (color != FastBoard::EMPTY) {
-                    if (color == to_move) {
-                        planes[our_offset + h][idx] = true;
-                    } else {
-                        planes[their_offset + h][idx] = true;
-                    }
-                }
+std::array<uint64, 2> Network::get_occupancy(const GameState * state) {
+    static_assert(BOARD_SQUARE_SIZE <= 64,
+                  "a board plane must fit in a 64-bit mask");
+    auto stones = std::array<uint64, 2>{};
+    for (int j = 0; j < BOARD_SIZE; j++) {
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            int vtx = state->board.get_vertex(i, j);
+            FastBoard::square_t color = state->board.get_square(vtx);
+            auto bit = uint64{1} << (j * BOARD_SIZE + i);
+            if (color == FastBoard::BLACK) {
+                stones[FastBoard::BLACK] |= bit;
+            } else if (color == FastBoard::WHITE) {
+                stones[FastBoard::WHITE] |= bit;
             }
         }
-        if (!state->undo_move()) {
-            break;
-        } else {
-            backtracks++;
-        }
-    }
-
-    // Now go back to present day
-    for (size_t h = 0; h < backtracks; h++) {
-        state->forward_move();
     }
+    return stones;
 }
 
-int Network::rotate_nn_idx(const int vertex, int symmetry) {
-    assert(vertex >= 0 && vertex < BOARD_SIZE*BOARD_SIZE);
-    assert(symmetry >= 0 && symmetry < 8);
-    int x = vertex % BOARD_SIZE;
-    int y = vertex / BOARD_SIZE;
-    int newx;
-    int newy;
-
-    if (symmetry >= 4) {
-        std::swap(x, y);
-        symmetry -= 4;
-    }
-
-    if (symmetry == 0) {
-        newx = x;
-        newy = y;
-    } else if (symmetry == 1) {
-        newx = x;
-        newy = BOARD_SIZE - y - 1;
-    } else if (symmetry == 2) {
-        newx = BOARD_SIZE - x - 1;
-        newy = y;
-    } else {
-        assert(symmetry == 3);
-        newx = BOARD_SIZE - x - 1;
-        newy = BOARD_SIZE - y - 1;
-    }
+void Network::gather_features(const GameState * state, NNPlanes & planes) {
+    auto stones = get_occupancy(state);
+    auto black_stones = stones[FastBoard::BLACK];
+    auto white_stones = stones[FastBoard::WHITE];
 
-    int newvtx = (newy * BOARD_SIZE) + newx;
-    assert(newvtx >= 0 && newvtx < BOARD_SIZE*BOARD_SIZE);
-    return newvtx;
+    bool whites_move = state->get_to_move() == FastBoard::WHITE;
+    planes[0] = whites_move ? white_stones : black_stones;
+    planes[1] = whites_move ? black_stones : white_stones;
+    planes[2] = whites_move ? BoardPlane{} : ~BoardPlane{};
+    planes[3] = whites_move ? ~BoardPlane{} : BoardPlane{};
 }
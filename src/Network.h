@@ -33,37 +33,152 @@ class UCTNode;
 
 #include "FastState.h"
 #include "GameState.h"
+#include "Workspace.h"
 
+#ifdef USE_OPENCL
+// Use the BLAS backend even though OpenCL support is compiled in
+extern bool cfg_cpu_only;
+#endif
+// Use Winograd F(4x4,3x3) for the 3x3 convolutions
+extern bool cfg_winograd;
+// Use the AVX2/AVX-512 convolutions for an 8x8 board when the CPU has them
+extern bool cfg_direct_conv;
+// Quantize the residual tower of the BLAS backend to int8
+extern bool cfg_int8;
+
+// The weights of one network, see Network::load_weights
+struct NetworkWeights;
+
+/*
+    A network with its own weights. The engine plays with get_Network(),
+    more networks (e.g. a candidate in a match) can be created and loaded
+    next to it. All of them share the backends and the evaluation queue,
+    a batch only holds positions of one network.
+*/
 class Network {
 public:
+    // AVERAGE evaluates all 8 symmetries in one batch and averages them
     enum Ensemble {
-        DIRECT, RANDOM_ROTATION
+        DIRECT, RANDOM_ROTATION, AVERAGE
     };
+    // Input planes: stones of the side to move, stones of the opponent,
+    // black to move, white to move
+    static constexpr int INPUT_CHANNELS = 4;
     using BoardPlane = std::bitset<BOARD_SIZE*BOARD_SIZE>;
-    using NNPlanes = std::vector<BoardPlane>;
+    using NNPlanes = std::array<BoardPlane, INPUT_CHANNELS>;
     using scored_node = std::pair<float, int>;
     using Netresult = std::pair<std::vector<scored_node>, float>;
 
-    static Netresult get_scored_moves(GameState * state,
-                                      Ensemble ensemble,
-                                      int rotation = -1);
     // File format version
     static constexpr int FORMAT_VERSION = 1;
-    static constexpr int INPUT_CHANNELS = 4;
-    static constexpr int MAX_CHANNELS = 256;
+    // Planes of the merged 1x1 convolution of the policy and value heads
+    static constexpr int HEAD_PLANES = 3;
 
+    // Algorithms of the BLAS tower convolutions. They are passed down
+    // instead of read from the cfg_ flags, so that a benchmark can try
+    // them while other threads keep evaluating.
+    struct ConvMode {
+        bool winograd;
+        bool direct;
+        // Layers without an int8 filter stay in fp32
+        bool int8;
+    };
+    // The mode the cfg_ flags ask for
+    static ConvMode get_conv_mode(void);
+
+    /*
+        set up the backends and the evaluation queue, and load
+        cfg_weightsfile into get_Network()
+    */
     static void initialize();
-    static void benchmark(GameState * state);
+    /*
+        threads of the evaluation queue and the batch size they run,
+        for this many OpenCL devices (0 for the BLAS backend)
+    */
+    static int get_queue_workers(size_t devices);
+    static int get_queue_batch_size(size_t devices);
+    /*
+        return the network the engine plays with
+    */
+    static Network& get_Network(void);
+
+    Network() = default;
+    Network(const Network&) = delete;
+    Network& operator=(const Network&) = delete;
+
+    /*
+        Load a weights file and switch to it once it is ready, without
+        stopping the searches: evaluations keep using the previous
+        network until then. Returns false and keeps the current network
+        if the file can't be used. The new network can have another
+        tower or value head width.
+    */
+    bool load_weights(const std::string& filename);
+
+    Netresult get_scored_moves(GameState * state,
+                               Ensemble ensemble,
+                               int rotation = -1);
+    // Evaluate several positions in a single forward pass
+    std::vector<Netresult> get_scored_moves_batch(
+        const std::vector<GameState*>& states,
+        Ensemble ensemble,
+        int rotation = -1);
+
+    // False if check_allocations fails
+    bool benchmark(GameState * state);
+    /*
+        Self-test of the workspace: after a few warm-up batches, batches
+        of the same size must not grow the forward pass buffers. Only
+        AlignedAllocator is counted, the queue requests are pooled and
+        the Netresult handed to a caller is its own. Prints the result
+        and returns false otherwise. Run it while nothing else evaluates.
+    */
+    bool check_allocations(GameState * state);
+    void calibrate(const std::vector<GameState*>& states);
+
     static void show_heatmap(FastState * state, Netresult & netres, bool topmoves);
     static void softmax(const std::vector<float>& input,
                         std::vector<float>& output,
                         float temperature = 1.0f);
-    static void gather_features(GameState* state, NNPlanes & planes);
+    static void gather_features(const GameState* state, NNPlanes & planes);
+    // Black and white stones as masks, bit (y * BOARD_SIZE + x)
+    static std::array<uint64, 2> get_occupancy(const GameState* state);
 
 private:
-    static Netresult get_scored_moves_internal(
-      GameState * state, NNPlanes & planes, int rotation);
-    static int rotate_nn_idx(const int vertex, int symmetry);
+    friend class NNQueue;
+    std::shared_ptr<const NetworkWeights> get_weights(void) const;
+    bool set_weights(std::shared_ptr<NetworkWeights> weights);
+    // Fills results, reusing the vectors already in it
+    void get_scored_moves_internal(
+      const std::vector<GameState*>& states,
+      std::vector<NNPlanes>& batch_planes,
+      const std::vector<int>& rotations,
+      std::vector<Netresult>& results);
+    static Netresult average_results(const Netresult * results,
+                                     size_t count);
+    // The tower output stays in a workspace buffer of the calling
+    // thread, valid until its next forward_cpu
+    static const aligned_vector& forward_cpu(const NetworkWeights& weights,
+                                             const aligned_vector& input,
+                                             size_t batch_size,
+                                             const ConvMode& mode);
+    static void forward_heads(const NetworkWeights& weights,
+                              const aligned_vector& tower_output,
+                              size_t batch_size,
+                              aligned_vector& policy,
+                              aligned_vector& winrate);
+    static void softmax(const float * input, float * output, size_t size,
+                        float temperature);
+#ifdef USE_OPENCL_SELFCHECK
+    static void compare_net_outputs(const aligned_vector& data,
+                                    const aligned_vector& ref);
+    // Check 1 in this many OpenCL evaluations against the BLAS backend
+    static constexpr unsigned int SELFCHECK_PROBABILITY = 2000;
+#endif
+
+    // Replaced as a whole by load_weights, evaluations that already
+    // hold the old weights finish with them before they are freed
+    std::shared_ptr<const NetworkWeights> m_weights;
 };
 
 #endif
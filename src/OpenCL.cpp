@@ -27,352 +27,534 @@
 #include <sstream>
 #include <fstream>
 #include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iterator>
+#include <random>
 #include <array>
+#include <algorithm>
 #include <thread>
+#include <unordered_map>
 #include <boost/algorithm/string.hpp>
-#include <boost/format.hpp>
 
 #include "Utils.h"
 #include "Timing.h"
 #include "OpenCL.h"
 #include "Network.h"
 #include "GTP.h"
+#ifdef USE_TUNER
+#include "NNQueue.h"
+#include "Tuner.h"
+#endif
+#include "half/half.hpp"
 
 using namespace Utils;
 
-static std::string sourceCode_convolve1 = boost::str(boost::format(R"(
-    __kernel
-    __attribute__((work_group_size_hint(8, 16, 1)))
-    void convolve1(
+// Store the convolution filters as fp16 on the device
+bool cfg_half_weights = false;
+// Don't split CPU devices
+int cfg_cpu_subdevices = 0;
+// Reuse the compiled kernels of earlier runs
+bool cfg_kernel_cache = true;
+
+// Compiled kernels are stored in this file plus a hash of everything
+// that affects the binary
+static const auto PROGRAM_CACHE_PREFIX = std::string{"yuki_opencl_kernels_"};
+
+// Filters are either float or half, biases are always float
+static std::string sourceCode_config = R"(
+    #ifdef USE_HALF
+    typedef half net_t;
+    #define load_w(i, p) vload_half(i, p)
+    #else
+    typedef float net_t;
+    #define load_w(i, p) p[i]
+    #endif
+)";
+
+static std::string sourceCode_convolve1 = R"(
+    // A work item computes one row of one output plane, summed over
+    // all input channels, and adds the bias, the optional residual
+    // and applies ReLU.
+    __kernel void convolve1(
                    __global const float * in,
-                   __global float * merge,
-                   __global const float * weights,
-                   __local float * channel_buff,
-                   __local float * row_buff) {
-        // cl::NDRange global(channels, outputs, row);
-        const int c   = get_global_id(0);  // channel
-        const int o   = get_global_id(1);  // output
-        const int row = get_global_id(2);  // row
+                   __global float * out,
+                   __global const net_t * weights,
+                   __constant const float * biases,
+                   __global const float * residual,
+                   const int channels) {
+        // cl::NDRange global(outputs, batch_size * BOARD_SIZE);
+        const int o = get_global_id(0);
+        const int batch_size = get_global_size(1) / BOARD_SIZE;
+        const int n = get_global_id(1) / BOARD_SIZE;    // position in batch
+        const int row = get_global_id(1) % BOARD_SIZE;  // row
+
+        // input = channels * batch_size * height * width
+        // output = outputs * batch_size * height * width
+        // weights = outputs * channels
+        float acc[BOARD_SIZE];
+        for (int x = 0; x < BOARD_SIZE; x++) {
+            acc[x] = 0.0f;
+        }
+        for (int c = 0; c < channels; c++) {
+            const float w = load_w(o * channels + c, weights);
+            __global const float * src =
+                in + (c * batch_size + n) * BOARD_SQUARE_SIZE + row * BOARD_SIZE;
+            for (int x = 0; x < BOARD_SIZE; x++) {
+                acc[x] += w * src[x];
+            }
+        }
 
-        const int channels = get_global_size(0);
-        const int outputs  = get_global_size(1);
-
-        // cl::NDRange local(2, (1->32), 1);
-        const int lx = get_local_id(0);
-        const int ly = get_local_id(1);
-
-        const int chan_buff_size = 8;
-        const int out_buff_size  = get_local_size(1);
-        const int row_buff_size  = 7;
-        const int chan_shift     = 3;
-
-        // input = channels * height * width
-        // output = outputs * height * width
-        // weights = output * channels * filter
-        // merge = channels * outputs * height * width
-
-        const int BOARD_SIZE = %d;
-        const int width = BOARD_SIZE;
-        const int height = BOARD_SIZE;
-        const int strip_size = width;
-
-        // Copy the input channels (strips) locally
-        if (out_buff_size < BOARD_SIZE && ly == 0) {
-            // strip-row
-            for (int w = 0; w < width; w++) {
-                channel_buff[lx * width + w] =
-                    in[(c * height + row) * width + w];
+        const int offset = (o * batch_size + n) * BOARD_SQUARE_SIZE + row * BOARD_SIZE;
+        const float bias = biases[o];
+        for (int x = 0; x < BOARD_SIZE; x++) {
+            float sum = acc[x] + bias;
+            if (residual) {
+                sum += residual[offset + x];
             }
-        } else if (out_buff_size >= BOARD_SIZE && ly < BOARD_SIZE) {
-            // Every thread copies a column
-            channel_buff[lx * width + ly] = in[(c * height + row) * width + ly];
-        }
-
-        // Copy the filter we are applying locally
-        __private float filter_buff = weights[(o * channels + c)];
-
-        barrier(CLK_LOCAL_MEM_FENCE);
-
-        int out_lane = 0;
-        int out_cw   = 0;
-        #pragma unroll
-        for (int cw = 0; cw < width; cw++) {
-            int fid = lx * strip_size;
-            float out  = channel_buff[fid + cw] * filter_buff;
-            row_buff[(ly * chan_buff_size + lx) * row_buff_size + out_lane] = out;
-            out_lane++;
-            // Row buffer full or last lane?
-            if (out_lane == row_buff_size || (cw == width - 1)) {
-                barrier(CLK_LOCAL_MEM_FENCE);
-                if (lx < out_lane) {
-                    float val;
-                    val  = row_buff[(ly * chan_buff_size + 0) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 1) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 2) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 3) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 4) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 5) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 6) * row_buff_size + lx];
-                    val += row_buff[(ly * chan_buff_size + 7) * row_buff_size + lx];
-                    merge[(((c >> chan_shift) * height + row) * width + out_cw + lx) * outputs + o] = val;
-                }
-                out_cw  += row_buff_size;
-                out_lane = 0;
-           }
-       }
+            out[offset + x] = sum > 0 ? sum : 0.0f;
+        }
     }
-)") % BOARD_SIZE);
-
-static std::string sourceCode_convolve3 = boost::str(boost::format(R"(
-    __kernel
-    __attribute__((work_group_size_hint(8, 32, 1)))
-    void convolve3(
+)";
+
+static std::string sourceCode_convolve3 = R"(
+    #define FILTER_SIZE 3
+    #define FILTER_LEN (FILTER_SIZE * FILTER_SIZE)
+    // One zero column on each side of a row
+    #define PAD_WIDTH (BOARD_SIZE + FILTER_SIZE - 1)
+    #define ROW_TILES ((BOARD_SIZE + ROW_TILE_SIZE - 1) / ROW_TILE_SIZE)
+    // Input rows a row tile reads
+    #define IN_ROWS (ROW_TILE_SIZE + FILTER_SIZE - 1)
+
+    // A work item computes ROW_TILE_SIZE rows of one output plane,
+    // summed over all input channels, and adds the bias, the optional
+    // residual and applies ReLU. The padded input rows are staged in
+    // local memory chan_group channels at a time and shared by all the
+    // outputs of the work group.
+    __kernel void convolve3(
                    __global const float * in,
-                   __global float * merge,
-                   __global const float * weights,
+                   __global float * out,
+                   __global const net_t * weights,
+                   __constant const float * biases,
+                   __global const float * residual,
                    __local float * channel_buff,
-                   __local float * row_buff,
-                   const int row_tile_size,
-                   const int row_buff_size,
-                   const int chan_buff_size,
-                   const int chan_shift) {
+                   const int channels,
+                   const int chan_group) {
+        // cl::NDRange global(outputs, batch_size * ROW_TILES);
+        // cl::NDRange local(output group, 1);
+        const int o = get_global_id(0);  // output
+        const int lo = get_local_id(0);
+        const int out_group = get_local_size(0);
+
+        const int batch_size = get_global_size(1) / ROW_TILES;
+        const int n = get_global_id(1) / ROW_TILES;  // position in batch
+        const int r = get_global_id(1) % ROW_TILES;  // row tile
+        const int row0 = r * ROW_TILE_SIZE;
+
+        // input = channels * batch_size * height * width
+        // output = outputs * batch_size * height * width
+        // weights = outputs * channels * filter
+        float acc[ROW_TILE_SIZE][BOARD_SIZE];
+        for (int ty = 0; ty < ROW_TILE_SIZE; ty++) {
+            for (int x = 0; x < BOARD_SIZE; x++) {
+                acc[ty][x] = 0.0f;
+            }
+        }
 
-        // cl::NDRange global(channels, outputs, row);
-        const int c   = get_global_id(0);  // channel
-        const int o   = get_global_id(1);  // output
-        const int r   = get_global_id(2);  // row
+        const int plane_size = IN_ROWS * PAD_WIDTH;
+        for (int c0 = 0; c0 < channels; c0 += chan_group) {
+            // Copy the padded rows of the channel group locally
+            for (int i = lo; i < chan_group * plane_size; i += out_group) {
+                const int c = i / plane_size;
+                const int idx = i - c * plane_size;
+                const int y = row0 - 1 + idx / PAD_WIDTH;
+                const int x = idx % PAD_WIDTH - 1;
+                float val = 0.0f;
+                if ((unsigned)y < BOARD_SIZE && (unsigned)x < BOARD_SIZE) {
+                    val = in[((c0 + c) * batch_size + n) * BOARD_SQUARE_SIZE
+                             + y * BOARD_SIZE + x];
+                }
+                channel_buff[i] = val;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
 
-        const int channels = get_global_size(0);
-        const int outputs  = get_global_size(1);
-
-        // cl::NDRange local(2, (1->32), 1);
-        const int lx = get_local_id(0);
-        const int ly = get_local_id(1);
-
-        const int out_buff_size  = get_local_size(1);
-        const int BOARD_SIZE = %d;
-        const int width = BOARD_SIZE;
-        const int height = BOARD_SIZE;
-
-        const int filter_size = 3;
-        const int filter_len = filter_size * filter_size;
-        const int mid = (filter_size / 2) + 1;
-        const int extent = mid - 1;
-        const int pad_width = width + filter_size - 1;
-
-        // input = channels * height * width
-        // output = outputs * height * width
-        // weights = output * channels * filter
-        // merge = channels * outputs * height * width
-
-        __private float filter_buff[9];
-        __private float chan_cache[2];
-        __private float stripe_cache[9];
-
-        // Copy the filter we are applying locally
-        // output * channel * filter_len
-        for (int f = 0; f < filter_len; f++) {
-            filter_buff[f] = weights[(o * channels + c) * filter_len + f];
-        }
-
-        for (int tile = 0; tile < row_tile_size; tile++) {
-            int row = r * row_tile_size + tile;
-            if (row > 18) break;
-
-            // Copy the input channels (strips) locally
-            if (out_buff_size < 21 && ly == 0) {
-                // strip-row
-                for (int srow = 0; srow < filter_size; srow++) {
-                    int in_row = row - extent + srow;
-                    channel_buff[(lx * pad_width + 0) * filter_size + srow]             = 0.0f;
-                    if ((unsigned)in_row < height) {
-                        for (int w = 0; w < width; w++) {
-                            float val = in[(c * height + in_row) * width + w];
-                            channel_buff[(lx * pad_width + w + extent) * filter_size + srow] = val;
-                        }
-                    } else {
-                        for (int w = 0; w < width; w++) {
-                            channel_buff[(lx * pad_width + w + extent) * filter_size + srow] = 0.0f;
-                        }
-                    }
-                    channel_buff[(lx * pad_width + pad_width - 1) * filter_size + srow] = 0.0f;
+            for (int c = 0; c < chan_group; c++) {
+                float filter[FILTER_LEN];
+                for (int f = 0; f < FILTER_LEN; f++) {
+                    filter[f] = load_w((o * channels + c0 + c) * FILTER_LEN + f, weights);
                 }
-            } else if (out_buff_size >= 21 && ly < 21) {
-                // Every thread copies a column
-                int copy_idx = (lx * pad_width + ly) * filter_size;
-                if (tile == 0 || row == 18) {
-                    // Every thread copies a column
-                    for (int srow = 0; srow < filter_size; srow++) {
-                        int in_row = row - extent + srow;
-                        float val = 0.0f;
-                        if ((unsigned)in_row < height && ly >= 1 && ly <= BOARD_SIZE) {
-                            val = in[(c * height + in_row) * width + ly - 1];
+                __local const float * plane = channel_buff + c * plane_size;
+                for (int ty = 0; ty < ROW_TILE_SIZE; ty++) {
+                    for (int ky = 0; ky < FILTER_SIZE; ky++) {
+                        __local const float * src = plane + (ty + ky) * PAD_WIDTH;
+                        const float f0 = filter[ky * FILTER_SIZE + 0];
+                        const float f1 = filter[ky * FILTER_SIZE + 1];
+                        const float f2 = filter[ky * FILTER_SIZE + 2];
+                        for (int x = 0; x < BOARD_SIZE; x++) {
+                            acc[ty][x] += f0 * src[x] + f1 * src[x + 1] + f2 * src[x + 2];
                         }
-                        channel_buff[copy_idx + srow] = val;
-                        if (srow > 0) {
-                            chan_cache[srow - 1] = val;
-                        }
-                    }
-                } else {
-                    int in_row = row - extent + 2;
-                    float val = 0.0f;
-                    if (ly >= 1 && ly <= BOARD_SIZE) {
-                        val = in[(c * height + in_row) * width + ly - 1];
                     }
-                    channel_buff[copy_idx + 0] = chan_cache[0];
-                    channel_buff[copy_idx + 1] = chan_cache[1];
-                    channel_buff[copy_idx + 2] = val;
-                    chan_cache[0] = chan_cache[1];
-                    chan_cache[1] = val;
                 }
             }
-
-            int out_lane = 0;
-            int out_cw   = 0;
-            __local float * out_row_buff = &row_buff[(ly * chan_buff_size + lx) * row_buff_size];
-            int fid = (lx * pad_width) * filter_size;
             barrier(CLK_LOCAL_MEM_FENCE);
+        }
 
-            for (int rc = 0; rc < 9; rc++) {
-                stripe_cache[rc] = channel_buff[fid + rc];
+        const float bias = biases[o];
+        for (int ty = 0; ty < ROW_TILE_SIZE; ty++) {
+            const int row = row0 + ty;
+            if (ROW_TILES * ROW_TILE_SIZE != BOARD_SIZE && row >= BOARD_SIZE) break;
+            const int offset = (o * batch_size + n) * BOARD_SQUARE_SIZE + row * BOARD_SIZE;
+            for (int x = 0; x < BOARD_SIZE; x++) {
+                float sum = acc[ty][x] + bias;
+                if (residual) {
+                    sum += residual[offset + x];
+                }
+                out[offset + x] = sum > 0 ? sum : 0.0f;
             }
+        }
+    }
+)";
+
+static std::string sourceCode_input = R"(
+    // Expands [batch_size][channels] bit masks (bit y * width + x) into
+    // the [channels][batch_size][BOARD_SQUARE_SIZE] float input planes
+    __kernel void expand_input(__global const ulong * masks,
+                               __global float * out) {
+        // cl::NDRange global(batch_size * BOARD_SQUARE_SIZE, channels);
+        const int b = get_global_id(0);
+        const int c = get_global_id(1);
+        const int spatial = get_global_size(0);
+        const int channels = get_global_size(1);
+
+        const int n = b / BOARD_SQUARE_SIZE;
+        const int idx = b - n * BOARD_SQUARE_SIZE;
+        out[c * spatial + b] = (float)((masks[n * channels + c] >> idx) & 1);
+    }
+)";
+
+static std::string sourceCode_heads = R"(
+    #define POLICY_PLANES 2
+
+    // 1x1 convolutions of both heads + bias + ReLU. The policy planes
+    // come first, then the value plane.
+    __kernel void head_convolve(__global const float * in,
+                                __global float * out,
+                                __constant const float * weights,
+                                __constant const float * biases,
+                                const int channels) {
+        // cl::NDRange global(batch_size * BOARD_SQUARE_SIZE, planes);
+        const int b = get_global_id(0);
+        const int o = get_global_id(1);
+        const int spatial = get_global_size(0);
+
+        float sum = biases[o];
+        for (int c = 0; c < channels; c++) {
+            sum += weights[o * channels + c] * in[c * spatial + b];
+        }
+        out[o * spatial + b] = sum > 0.0f ? sum : 0.0f;
+    }
 
-            #pragma unroll
-            for (int cw = 0; cw < width; cw++) {
-                // Start filter
-                float out  =   stripe_cache[      0] * filter_buff[0]
-                             + stripe_cache[      1] * filter_buff[3]
-                             + stripe_cache[      2] * filter_buff[6]
-                             + stripe_cache[      3] * filter_buff[1]
-                             + stripe_cache[      4] * filter_buff[4]
-                             + stripe_cache[      5] * filter_buff[7]
-                             + stripe_cache[      6] * filter_buff[2]
-                             + stripe_cache[      7] * filter_buff[5]
-                             + stripe_cache[      8] * filter_buff[8];
-                // End filter
-                out_row_buff[out_lane++] = out;
-                fid += filter_size;
-
-                for (int rc = 0; rc < 6; rc++) {
-                    stripe_cache[rc] = stripe_cache[rc + 3];
-                }
-                stripe_cache[6] = channel_buff[fid + 6];
-                stripe_cache[7] = channel_buff[fid + 7];
-                stripe_cache[8] = channel_buff[fid + 8];
-
-                // Row buffer full or last lane?
-                if (out_lane == row_buff_size || (cw == width - 1)) {
-                    barrier(CLK_LOCAL_MEM_FENCE);
-                    if (lx < out_lane) {
-                        // lx = channels 2 or 8, ly = outputs 32
-                        // repurpose the lx threads over columns now
-                        if (chan_buff_size == 8) {
-                            float val;
-                            val  = row_buff[(ly * chan_buff_size + 0) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 1) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 2) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 3) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 4) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 5) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 6) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 7) * row_buff_size + lx];
-                            merge[(((c >> chan_shift) * height + row) * width + out_cw + lx) * outputs + o] = val;
-                        } else if (chan_buff_size == 2) {
-                            float val;
-                            val  = row_buff[(ly * chan_buff_size + 0) * row_buff_size + lx];
-                            val += row_buff[(ly * chan_buff_size + 1) * row_buff_size + lx];
-                            merge[(((c >> chan_shift) * height + row) * width + out_cw + lx) * outputs + o] = val;
-                        }
-                    }
-                    out_cw  += row_buff_size;
-                    out_lane = 0;
-                }
+    __kernel void policy_fc(__global const float * in,
+                            __global float * logits,
+                            __global const float * weights,
+                            __constant const float * biases,
+                            const int batch_size) {
+        // cl::NDRange global(BOARD_ACTION_N, batch_size);
+        const int a = get_global_id(0);
+        const int n = get_global_id(1);
+
+        float sum = biases[a];
+        for (int c = 0; c < POLICY_PLANES; c++) {
+            __global const float * plane = in + (c * batch_size + n) * BOARD_SQUARE_SIZE;
+            __global const float * w = weights + (a * POLICY_PLANES + c) * BOARD_SQUARE_SIZE;
+            for (int i = 0; i < BOARD_SQUARE_SIZE; i++) {
+                sum += w[i] * plane[i];
             }
         }
+        logits[n * BOARD_ACTION_N + a] = sum;
     }
-)") % BOARD_SIZE);
 
-static std::string sourceCode_utility = boost::str(boost::format(R"(
-    __kernel void merge(
-                        __global const float * in,
-                        __global float * out,
-                        __constant const float * biases,
-                        __private const int channels) {
+    // out is [batch_size][BOARD_ACTION_N] probabilities, then
+    // [batch_size] winrates
+    __kernel void policy_softmax(__global const float * logits,
+                                 __global float * out,
+                                 const float temperature) {
+        // cl::NDRange global(batch_size);
+        const int n = get_global_id(0);
+        __global const float * in = logits + n * BOARD_ACTION_N;
+        __global float * probs = out + n * BOARD_ACTION_N;
+
+        float alpha = in[0];
+        for (int a = 1; a < BOARD_ACTION_N; a++) {
+            alpha = fmax(alpha, in[a]);
+        }
+        alpha /= temperature;
+        float denom = 0.0f;
+        for (int a = 0; a < BOARD_ACTION_N; a++) {
+            const float val = exp(in[a] / temperature - alpha);
+            probs[a] = val;
+            denom += val;
+        }
+        for (int a = 0; a < BOARD_ACTION_N; a++) {
+            probs[a] /= denom;
+        }
+    }
 
-        // cl::NDRange global(outputs, BOARD_SIZE*BOARD_SIZE);
-        const int gx = get_global_id(0);
-        const int gy = get_global_id(1);
+    __kernel void value_fc1(__global const float * in,
+                            __global float * out,
+                            __global const float * weights,
+                            __constant const float * biases,
+                            const int batch_size,
+                            const int value_fc) {
+        // cl::NDRange global(value_fc, batch_size);
+        const int i = get_global_id(0);
+        const int n = get_global_id(1);
+        __global const float * plane =
+            in + (POLICY_PLANES * batch_size + n) * BOARD_SQUARE_SIZE;
+        __global const float * w = weights + i * BOARD_SQUARE_SIZE;
+
+        float sum = biases[i];
+        for (int s = 0; s < BOARD_SQUARE_SIZE; s++) {
+            sum += w[s] * plane[s];
+        }
+        out[n * value_fc + i] = sum > 0.0f ? sum : 0.0f;
+    }
 
-        const int output = gx;
-        const int b = gy;
-        const int outputs = get_global_size(0);
+    __kernel void value_fc2(__global const float * in,
+                            __global float * out,
+                            __constant const float * weights,
+                            __constant const float * biases,
+                            const int batch_size,
+                            const int value_fc) {
+        // cl::NDRange global(batch_size);
+        const int n = get_global_id(0);
+        __global const float * fc = in + n * value_fc;
+
+        float sum = biases[0];
+        for (int i = 0; i < value_fc; i++) {
+            sum += weights[i] * fc[i];
+        }
+        out[batch_size * BOARD_ACTION_N + n] = (1.0f + tanh(sum)) / 2.0f;
+    }
+)";
+
+static std::string sourceCode_winograd = R"(
+    #define WINOGRAD_TILE (WINOGRAD_ALPHA * WINOGRAD_ALPHA)
+    #define WINOGRAD_WTILES (BOARD_SIZE / WINOGRAD_M)
+    #define WINOGRAD_P (WINOGRAD_WTILES * WINOGRAD_WTILES)
+
+    // y = B^T x
+    void multiply_bt(const float * x, float * y, const int stride) {
+        y[0 * stride] = 4.0f * x[0 * stride] - 5.0f * x[2 * stride] + x[4 * stride];
+        y[1 * stride] = -4.0f * x[1 * stride] - 4.0f * x[2 * stride]
+                        + x[3 * stride] + x[4 * stride];
+        y[2 * stride] = 4.0f * x[1 * stride] - 4.0f * x[2 * stride]
+                        - x[3 * stride] + x[4 * stride];
+        y[3 * stride] = -2.0f * x[1 * stride] - x[2 * stride]
+                        + 2.0f * x[3 * stride] + x[4 * stride];
+        y[4 * stride] = 2.0f * x[1 * stride] - x[2 * stride]
+                        - 2.0f * x[3 * stride] + x[4 * stride];
+        y[5 * stride] = 4.0f * x[1 * stride] - 5.0f * x[3 * stride] + x[5 * stride];
+    }
 
-        const int BOARD_SIZE = %d;
-        const int width = BOARD_SIZE;
-        const int height = BOARD_SIZE;
-        const int boardsize = width * height;
+    // y = A^T x
+    void multiply_at(const float * x, float * y, const int stride) {
+        y[0 * stride] = x[0 * stride] + x[1 * stride] + x[2 * stride]
+                        + x[3 * stride] + x[4 * stride];
+        y[1 * stride] = x[1 * stride] - x[2 * stride]
+                        + 2.0f * x[3 * stride] - 2.0f * x[4 * stride];
+        y[2 * stride] = x[1 * stride] + x[2 * stride]
+                        + 4.0f * x[3 * stride] + 4.0f * x[4 * stride];
+        y[3 * stride] = x[1 * stride] - x[2 * stride]
+                        + 8.0f * x[3 * stride] - 8.0f * x[4 * stride] + x[5 * stride];
+    }
 
-        const int o = output;
-        const float bias = biases[o];
+    __kernel void in_transform(__global const float * in,
+                               __global float * V,
+                               const int batch_size) {
+        // cl::NDRange global(channels, batch_size * WINOGRAD_P);
+        const int c = get_global_id(0);
+        const int t = get_global_id(1);
 
-        float sum = bias;
-        for (int c = 0; c < channels; c++) {
-            sum += in[(c * boardsize + b) * outputs + o];
+        const int channels = get_global_size(0);
+        const int tiles = get_global_size(1);
+
+        const int W = BOARD_SIZE;
+        const int H = BOARD_SIZE;
+
+        const int n = t / WINOGRAD_P;
+        const int tile = t - n * WINOGRAD_P;
+        const int y0 = (tile / WINOGRAD_WTILES) * WINOGRAD_M - 1;
+        const int x0 = (tile - (tile / WINOGRAD_WTILES) * WINOGRAD_WTILES)
+                       * WINOGRAD_M - 1;
+
+        __global const float * plane = in + (c * batch_size + n) * W * H;
+
+        float d[WINOGRAD_TILE];
+        float t1[WINOGRAD_TILE];
+        float v[WINOGRAD_TILE];
+
+        for (int i = 0; i < WINOGRAD_ALPHA; i++) {
+            for (int j = 0; j < WINOGRAD_ALPHA; j++) {
+                const int y = y0 + i;
+                const int x = x0 + j;
+                float val = 0.0f;
+                if ((unsigned)y < H && (unsigned)x < W) {
+                    val = plane[y * W + x];
+                }
+                d[i * WINOGRAD_ALPHA + j] = val;
+            }
+        }
+        for (int j = 0; j < WINOGRAD_ALPHA; j++) {
+            multiply_bt(&d[j], &t1[j], WINOGRAD_ALPHA);
+        }
+        for (int i = 0; i < WINOGRAD_ALPHA; i++) {
+            multiply_bt(&t1[i * WINOGRAD_ALPHA], &v[i * WINOGRAD_ALPHA], 1);
+        }
+        for (int b = 0; b < WINOGRAD_TILE; b++) {
+            V[(b * channels + c) * tiles + t] = v[b];
         }
-        out[o * boardsize + b] = sum;
     }
 
-    __kernel void batchnorm(
-                        __global const float * in,
-                        __global float * out,
-                        __global const float * residual,
-                        __constant const float * means,
-                        __constant const float * variances) {
+    // M[b][K][T] = U[b][K][C] x V[b][C][T], one matrix per tile point b.
+    // A work group computes WINOGRAD_TS x WINOGRAD_TS outputs, each work
+    // item WINOGRAD_VW consecutive tiles of one output.
+    __kernel
+    __attribute__((reqd_work_group_size(WINOGRAD_TS / WINOGRAD_VW, WINOGRAD_TS, 1)))
+    void winograd_sgemm(__global const net_t * U,
+                        __global const float * V,
+                        __global float * M,
+                        const int K, const int C, const int T) {
+        // cl::NDRange global(T rounded up / WINOGRAD_VW, K rounded up,
+        //                    WINOGRAD_TILE);
+        const int lt = get_local_id(0) * WINOGRAD_VW;
+        const int lk = get_local_id(1);
+        const int t = get_group_id(0) * WINOGRAD_TS + lt;
+        const int k = get_global_id(1);
+        const int b = get_global_id(2);
+
+        __local float Us[WINOGRAD_TS][WINOGRAD_TS];
+        __local float Vs[WINOGRAD_TS][WINOGRAD_TS];
+
+        U += b * K * C;
+        V += b * C * T;
+
+        float acc[WINOGRAD_VW];
+        for (int v = 0; v < WINOGRAD_VW; v++) {
+            acc[v] = 0.0f;
+        }
+        for (int c0 = 0; c0 < C; c0 += WINOGRAD_TS) {
+            const int vc = c0 + lk;
+            for (int v = 0; v < WINOGRAD_VW; v++) {
+                const int uc = c0 + lt + v;
+                Us[lk][lt + v] = (k < K && uc < C) ? load_w(k * C + uc, U) : 0.0f;
+                Vs[lk][lt + v] = (vc < C && t + v < T) ? V[vc * T + t + v] : 0.0f;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+            for (int i = 0; i < WINOGRAD_TS; i++) {
+                const float u = Us[lk][i];
+                for (int v = 0; v < WINOGRAD_VW; v++) {
+                    acc[v] += u * Vs[i][lt + v];
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        for (int v = 0; v < WINOGRAD_VW; v++) {
+            if (k < K && t + v < T) {
+                M[(b * K + k) * T + t + v] = acc[v];
+            }
+        }
+    }
 
-        const int BOARD_SIZE = BOARD_SIZE;
-        // cl::NDRange global(outputs, BOARD_SIZE*BOARD_SIZE);
-        const int gx = get_global_id(0);
-        const int gy = get_global_id(1);
+    __kernel void out_transform(__global const float * M,
+                                __global float * out,
+                                __constant const float * biases,
+                                __global const float * residual,
+                                const int batch_size) {
+        // cl::NDRange global(outputs, batch_size * WINOGRAD_P);
+        const int k = get_global_id(0);
+        const int t = get_global_id(1);
 
-        const int output = gx;
-        const int outputs      = get_global_size(0);
-        const int channel_size = get_global_size(1);
+        const int outputs = get_global_size(0);
+        const int tiles = get_global_size(1);
 
-        const unsigned int o = output;
-        const unsigned int b = gy;
+        const int W = BOARD_SIZE;
+        const int H = BOARD_SIZE;
 
-        const float epsilon = 1e-5;
+        const int n = t / WINOGRAD_P;
+        const int tile = t - n * WINOGRAD_P;
+        const int y0 = (tile / WINOGRAD_WTILES) * WINOGRAD_M;
+        const int x0 = (tile - (tile / WINOGRAD_WTILES) * WINOGRAD_WTILES)
+                       * WINOGRAD_M;
 
-        const float mean = means[o];
-        const float variance = epsilon + variances[o];
-        const float scale_stddiv = 1.0f / sqrt(variance);
+        float m[WINOGRAD_TILE];
+        float t1[WINOGRAD_M * WINOGRAD_ALPHA];
+        float y[WINOGRAD_M * WINOGRAD_M];
 
-        // BN
-        float sum = scale_stddiv * (in[o * channel_size + b] - mean);
-        // Residual Eltwise
-        if (residual) {
-            sum += residual[o * channel_size + b];
+        for (int b = 0; b < WINOGRAD_TILE; b++) {
+            m[b] = M[(b * outputs + k) * tiles + t];
+        }
+        for (int j = 0; j < WINOGRAD_ALPHA; j++) {
+            multiply_at(&m[j], &t1[j], WINOGRAD_ALPHA);
+        }
+        for (int i = 0; i < WINOGRAD_M; i++) {
+            multiply_at(&t1[i * WINOGRAD_ALPHA], &y[i * WINOGRAD_M], 1);
         }
-        // ReLU
-        out[o * channel_size + b] = sum > 0 ? sum : 0.0f;
-    }
-)") % BOARD_SIZE);
 
-OpenCL opencl;
-OpenCL_Network opencl_net;
-thread_local ThreadData opencl_thread_data;
+        const float bias = biases[k];
+        const int offset = (k * batch_size + n) * W * H;
+        for (int i = 0; i < WINOGRAD_M; i++) {
+            for (int j = 0; j < WINOGRAD_M; j++) {
+                const int idx = offset + (y0 + i) * W + x0 + j;
+                float sum = y[i * WINOGRAD_M + j] + bias;
+                if (residual) {
+                    sum += residual[idx];
+                }
+                out[idx] = sum > 0 ? sum : 0.0f;
+            }
+        }
+    }
+)";
+
+OpenCLScheduler opencl;
+// Kernels and buffers of the calling thread, by device index
+static thread_local std::unordered_map<size_t, ThreadData> opencl_thread_data;
+
+// The sizes the kernels are compiled for, so that the board and tile
+// loops are unrolled and the Go-sized edge cases fold away. The layer
+// widths are kernel arguments, one program runs every network.
+static std::string get_build_defines(const Tuners& tuners) {
+    std::ostringstream defines;
+    defines << " -DBOARD_SIZE=" << BOARD_SIZE
+            << " -DBOARD_SQUARE_SIZE=" << BOARD_SQUARE_SIZE
+            << " -DBOARD_ACTION_N=" << BOARD_ACTION_N
+            << " -DROW_TILE_SIZE=" << tuners.row_tile_size
+            << " -DWINOGRAD_M=" << WINOGRAD_M
+            << " -DWINOGRAD_ALPHA=" << WINOGRAD_ALPHA
+            << " -DWINOGRAD_TS=" << tuners.winograd_ts
+            << " -DWINOGRAD_VW=" << tuners.winograd_vw;
+    return defines.str();
+}
 
-void OpenCL::ensure_thread_initialized() {
-    if (!opencl_thread_data.m_is_initialized) {
+ThreadData& OpenCL::get_thread_data() {
+    auto& thread_data = opencl_thread_data[m_index];
+    if (!thread_data.m_is_initialized) {
         // Make kernels
-        opencl_thread_data.m_convolve1_kernel = cl::Kernel(m_program, "convolve1");
-        opencl_thread_data.m_convolve3_kernel = cl::Kernel(m_program, "convolve3");
-        opencl_thread_data.m_merge_kernel = cl::Kernel(m_program, "merge");
-        opencl_thread_data.m_batchnorm_kernel = cl::Kernel(m_program, "batchnorm");
-        opencl_thread_data.m_commandqueue = cl::CommandQueue(cl::Context::getDefault(),
-                                                             cl::Device::getDefault());
-        opencl_thread_data.m_is_initialized = true;
+        thread_data.m_convolve1_kernel = cl::Kernel(m_program, "convolve1");
+        thread_data.m_convolve3_kernel = cl::Kernel(m_program, "convolve3");
+        thread_data.m_expand_input_kernel = cl::Kernel(m_program, "expand_input");
+        thread_data.m_head_convolve_kernel = cl::Kernel(m_program, "head_convolve");
+        thread_data.m_policy_fc_kernel = cl::Kernel(m_program, "policy_fc");
+        thread_data.m_softmax_kernel = cl::Kernel(m_program, "policy_softmax");
+        thread_data.m_value_fc1_kernel = cl::Kernel(m_program, "value_fc1");
+        thread_data.m_value_fc2_kernel = cl::Kernel(m_program, "value_fc2");
+        thread_data.m_in_transform_kernel = cl::Kernel(m_program, "in_transform");
+        thread_data.m_sgemm_kernel = cl::Kernel(m_program, "winograd_sgemm");
+        thread_data.m_out_transform_kernel = cl::Kernel(m_program, "out_transform");
+        thread_data.m_commandqueue = cl::CommandQueue(m_context, m_device);
+        thread_data.m_is_initialized = true;
     }
+    return thread_data;
 }
 
 void OpenCL_Network::add_weights(size_t layer,
@@ -385,252 +567,398 @@ void OpenCL_Network::add_weights(size_t layer,
     size_t weightSize = size *
         sizeof(std::remove_pointer<decltype(weights)>::type);
 
-    cl::Buffer bufferWeights = cl::Buffer(CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+    cl::Buffer bufferWeights = cl::Buffer(m_opencl.m_context,
+                                          CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
                                           weightSize, const_cast<float*>(weights));
 
     m_layers.back().weights.push_back(bufferWeights);
 }
 
-void OpenCL_Network::forward(const std::vector<float>& input,
-                             std::vector<float>& output) {
+void OpenCL_Network::push_filter(size_t layer,
+                                 const std::vector<float> & weights) {
+    if (!cfg_half_weights) {
+        add_weights(layer, weights.size(), weights.data());
+        return;
+    }
+    if (layer >= m_layers.size()) {
+        m_layers.push_back(Layer());
+    }
+
+    auto half_weights = std::vector<half_float::half>(weights.size());
+    std::transform(begin(weights), end(weights), begin(half_weights),
+                   [](float w) { return half_float::half(w); });
+
+    size_t weightSize = half_weights.size() * sizeof(half_float::half);
+
+    cl::Buffer bufferWeights = cl::Buffer(m_opencl.m_context,
+                                          CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                                          weightSize, half_weights.data());
+
+    m_layers.back().weights.push_back(bufferWeights);
+}
+
+void OpenCL_Network::push_heads(const std::vector<float> & conv_w,
+                                const std::vector<float> & conv_b,
+                                const std::vector<float> & policy_w,
+                                const std::vector<float> & policy_b,
+                                const std::vector<float> & value1_w,
+                                const std::vector<float> & value1_b,
+                                const std::vector<float> & value2_w,
+                                const std::vector<float> & value2_b) {
+    assert(conv_b.size() == Network::HEAD_PLANES);
+    m_value_fc = value1_b.size();
+    assert(value1_w.size() == size_t(m_value_fc) * BOARD_SQUARE_SIZE);
+    assert(value2_w.size() == size_t(m_value_fc));
+    for (auto weights : {&conv_w, &conv_b, &policy_w, &policy_b,
+                         &value1_w, &value1_b, &value2_w, &value2_b}) {
+        m_head_weights.emplace_back(m_opencl.m_context,
+                                    CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                                    weights->size() * sizeof(float),
+                                    const_cast<float*>(weights->data()));
+    }
+}
+
+size_t OpenCL_Network::get_max_channels() const {
+    auto max_channels = size_t{0};
+    for (const auto& layer : m_layers) {
+        max_channels = std::max({max_channels, size_t(layer.channels),
+                                 size_t(layer.outputs)});
+    }
+    return max_channels;
+}
+
+void OpenCL_Network::forward(const aligned_uint64_vector& input,
+                             aligned_vector& policy,
+                             aligned_vector& winrate,
+                             size_t batch_size) {
     constexpr int width = BOARD_SIZE;
     constexpr int height = BOARD_SIZE;
     constexpr size_t one_plane = width * height * sizeof(float);
 
-    opencl.ensure_thread_initialized();
-    const size_t midSize = one_plane * Network::MAX_CHANNELS;
-    const size_t inSize = sizeof(float) * input.size();
-    const size_t finalSize = m_layers.back().outputs * one_plane;
-
-    if (!opencl_thread_data.m_buffers_allocated) {
-        size_t alloc_midSize = one_plane * Network::MAX_CHANNELS;
-        size_t alloc_mergeSize = one_plane *
-            Network::MAX_CHANNELS * (Network::MAX_CHANNELS / 2);
-
-        opencl_thread_data.m_inBuffer = cl::Buffer(
-            CL_MEM_READ_WRITE, alloc_midSize);
-        opencl_thread_data.m_tmpBuffer = cl::Buffer(
-            CL_MEM_READ_WRITE, alloc_midSize);
-        opencl_thread_data.m_residualBuffer = cl::Buffer(
-            CL_MEM_READ_WRITE, alloc_midSize);
-        opencl_thread_data.m_mergeBuffer = cl::Buffer(
-            CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_mergeSize);
-        opencl_thread_data.m_outBuffer = cl::Buffer(
-            CL_MEM_WRITE_ONLY, finalSize);
-        opencl_thread_data.m_buffers_allocated = true;
-    }
-
-    cl::Buffer & inBuffer = opencl_thread_data.m_inBuffer;
-    cl::Buffer & outBuffer = opencl_thread_data.m_outBuffer;
-    cl::Buffer & tmpBuffer = opencl_thread_data.m_tmpBuffer;
-    cl::Buffer & mergeBuffer = opencl_thread_data.m_mergeBuffer;
-    cl::Buffer & residualBuffer = opencl_thread_data.m_residualBuffer;
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
-
-    // XXX: this copies a lot of zeroes
-    queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, input.data());
+    auto& thread_data = m_opencl.get_thread_data();
+    cl::Context & context = m_opencl.m_context;
+    const size_t inSize = sizeof(uint64) * input.size();
+    const int inChannels = m_layers.front().channels;
+    assert(input.size() == inChannels * batch_size);
+    // Only the probabilities and the winrate are read back
+    const size_t policySize = sizeof(float) * BOARD_ACTION_N * batch_size;
+    const size_t winrateSize = sizeof(float) * batch_size;
+
+    // The buffers of a thread are shared by the networks on the device,
+    // so they grow to the largest batch and widths seen so far
+    if (thread_data.m_batch_size < batch_size
+        || thread_data.m_channels < get_max_channels()
+        || thread_data.m_value_fc < size_t(m_value_fc)) {
+        thread_data.m_batch_size = std::max(thread_data.m_batch_size,
+                                            batch_size);
+        thread_data.m_channels = std::max(thread_data.m_channels,
+                                          get_max_channels());
+        thread_data.m_value_fc = std::max(thread_data.m_value_fc,
+                                          size_t(m_value_fc));
+        const auto alloc_batch = thread_data.m_batch_size;
+        const auto alloc_channels = thread_data.m_channels;
+        const size_t alloc_midSize = one_plane * alloc_channels * alloc_batch;
+        const size_t alloc_policySize =
+            sizeof(float) * BOARD_ACTION_N * alloc_batch;
+
+        thread_data.m_maskBuffer = cl::Buffer(
+            context, CL_MEM_READ_ONLY,
+            sizeof(uint64) * Network::INPUT_CHANNELS * alloc_batch);
+        thread_data.m_inBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE, alloc_midSize);
+        thread_data.m_tmpBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE, alloc_midSize);
+        thread_data.m_residualBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE, alloc_midSize);
+        thread_data.m_headBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+            Network::HEAD_PLANES * one_plane * alloc_batch);
+        thread_data.m_logitsBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+            alloc_policySize);
+        thread_data.m_valueBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+            sizeof(float) * thread_data.m_value_fc * alloc_batch);
+        thread_data.m_outBuffer = cl::Buffer(
+            context, CL_MEM_WRITE_ONLY,
+            alloc_policySize + sizeof(float) * alloc_batch);
+        // Winograd transformed inputs and outputs
+        size_t alloc_winogradSize = sizeof(float) * WINOGRAD_TILE *
+            alloc_channels * WINOGRAD_P * alloc_batch;
+        thread_data.m_VBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_winogradSize);
+        thread_data.m_MBuffer = cl::Buffer(
+            context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_winogradSize);
+    }
+
+    cl::Buffer & inBuffer = thread_data.m_inBuffer;
+    cl::Buffer & outBuffer = thread_data.m_outBuffer;
+    cl::Buffer & tmpBuffer = thread_data.m_tmpBuffer;
+    cl::Buffer & residualBuffer = thread_data.m_residualBuffer;
+    cl::CommandQueue & queue = thread_data.m_commandqueue;
+
+    // A few bytes per position cross the bus, the float planes are
+    // built on the device
+    cl::Buffer & maskBuffer = thread_data.m_maskBuffer;
+    cl::Kernel & expand_kernel = thread_data.m_expand_input_kernel;
+    queue.enqueueWriteBuffer(maskBuffer, CL_FALSE, 0, inSize, input.data());
+    try {
+        expand_kernel.setArg(0, maskBuffer);
+        expand_kernel.setArg(1, inBuffer);
+        queue.enqueueNDRangeKernel(expand_kernel, cl::NullRange,
+                                   cl::NDRange(BOARD_SQUARE_SIZE * batch_size,
+                                               inChannels));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in expand_input: " << e.what() << ": "
+            << e.err() << std::endl;
+        throw;
+    }
 
     for (auto& layer : m_layers) {
-        if (layer.is_batchnorm) {
-            batchnorm(layer.outputs,
-                      layer.filter_size,
-                      inBuffer,
-                      tmpBuffer,
-                      nullptr,
-                      layer.weights);
-            std::swap(inBuffer, tmpBuffer);
-        } else if (layer.is_residual_block) {
+        if (layer.is_residual_block) {
             auto conv1_weights = std::vector<cl::Buffer>(begin(layer.weights),
                                                          begin(layer.weights) + 2);
-            auto bn1_weights   = std::vector<cl::Buffer>(begin(layer.weights) + 2,
+            auto conv2_weights = std::vector<cl::Buffer>(begin(layer.weights) + 2,
                                                          begin(layer.weights) + 4);
-            auto conv2_weights = std::vector<cl::Buffer>(begin(layer.weights) + 4,
-                                                         begin(layer.weights) + 6);
-            auto bn2_weights   = std::vector<cl::Buffer>(begin(layer.weights) + 6,
-                                                         begin(layer.weights) + 8);
-            queue.enqueueCopyBuffer(inBuffer, residualBuffer, 0, 0, midSize);
             convolve(layer.filter_size,
                      layer.channels,
                      layer.outputs,
+                     batch_size,
+                     layer.is_winograd,
                      inBuffer,
                      tmpBuffer,
-                     mergeBuffer,
+                     nullptr,
                      conv1_weights);
-            std::swap(inBuffer, tmpBuffer);
-            batchnorm(layer.outputs,
-                      BOARD_SQUARE_SIZE,
-                      inBuffer,
-                      tmpBuffer,
-                      nullptr,
-                      bn1_weights);
-            std::swap(inBuffer, tmpBuffer);
+            // The block input is still in inBuffer and is added back
+            // by the second convolution
             convolve(layer.filter_size,
                      layer.channels,
                      layer.outputs,
-                     inBuffer,
+                     batch_size,
+                     layer.is_winograd,
                      tmpBuffer,
-                     mergeBuffer,
+                     residualBuffer,
+                     &inBuffer,
                      conv2_weights);
-            std::swap(inBuffer, tmpBuffer);
-            batchnorm(layer.outputs,
-                      BOARD_SQUARE_SIZE,
-                      inBuffer,
-                      tmpBuffer,
-                      &residualBuffer,
-                      bn2_weights);
-            std::swap(inBuffer, tmpBuffer);
+            std::swap(inBuffer, residualBuffer);
         } else  {
             // plain convolution
             convolve(layer.filter_size,
                      layer.channels,
                      layer.outputs,
+                     batch_size,
+                     layer.is_winograd,
                      inBuffer,
                      tmpBuffer,
-                     mergeBuffer,
+                     nullptr,
                      layer.weights);
             std::swap(inBuffer, tmpBuffer);
         }
     }
 
-    queue.enqueueCopyBuffer(inBuffer, outBuffer, 0, 0, finalSize);
-    queue.enqueueReadBuffer(outBuffer, CL_FALSE, 0, finalSize, output.data());
+    heads(batch_size, inBuffer, outBuffer);
+
+    policy.resize(BOARD_ACTION_N * batch_size);
+    winrate.resize(batch_size);
+    queue.enqueueReadBuffer(outBuffer, CL_FALSE, 0, policySize, policy.data());
+    queue.enqueueReadBuffer(outBuffer, CL_FALSE, policySize, winrateSize,
+                            winrate.data());
 
     queue.finish();
 }
 
+void OpenCL_Network::heads(size_t batch_size,
+                           cl::Buffer& bufferInput,
+                           cl::Buffer& bufferOutput) {
+    auto& thread_data = m_opencl.get_thread_data();
+    cl::CommandQueue & queue = thread_data.m_commandqueue;
+    cl::Kernel & convolve_kernel = thread_data.m_head_convolve_kernel;
+    cl::Kernel & policy_fc_kernel = thread_data.m_policy_fc_kernel;
+    cl::Kernel & softmax_kernel = thread_data.m_softmax_kernel;
+    cl::Kernel & value_fc1_kernel = thread_data.m_value_fc1_kernel;
+    cl::Kernel & value_fc2_kernel = thread_data.m_value_fc2_kernel;
+    cl::Buffer & bufferHead = thread_data.m_headBuffer;
+    cl::Buffer & bufferLogits = thread_data.m_logitsBuffer;
+    cl::Buffer & bufferValue = thread_data.m_valueBuffer;
+    auto& weights = m_head_weights;
+    const int batch = batch_size;
+
+    try {
+        convolve_kernel.setArg(0, bufferInput);
+        convolve_kernel.setArg(1, bufferHead);
+        convolve_kernel.setArg(2, weights[0]);
+        convolve_kernel.setArg(3, weights[1]);
+        convolve_kernel.setArg(4, int(m_layers.back().outputs));
+        queue.enqueueNDRangeKernel(convolve_kernel, cl::NullRange,
+                                   cl::NDRange(BOARD_SQUARE_SIZE * batch_size,
+                                               Network::HEAD_PLANES));
+
+        policy_fc_kernel.setArg(0, bufferHead);
+        policy_fc_kernel.setArg(1, bufferLogits);
+        policy_fc_kernel.setArg(2, weights[2]);
+        policy_fc_kernel.setArg(3, weights[3]);
+        policy_fc_kernel.setArg(4, batch);
+        queue.enqueueNDRangeKernel(policy_fc_kernel, cl::NullRange,
+                                   cl::NDRange(BOARD_ACTION_N, batch_size));
+
+        softmax_kernel.setArg(0, bufferLogits);
+        softmax_kernel.setArg(1, bufferOutput);
+        softmax_kernel.setArg(2, cfg_softmax_temp);
+        queue.enqueueNDRangeKernel(softmax_kernel, cl::NullRange,
+                                   cl::NDRange(batch_size));
+
+        value_fc1_kernel.setArg(0, bufferHead);
+        value_fc1_kernel.setArg(1, bufferValue);
+        value_fc1_kernel.setArg(2, weights[4]);
+        value_fc1_kernel.setArg(3, weights[5]);
+        value_fc1_kernel.setArg(4, batch);
+        value_fc1_kernel.setArg(5, m_value_fc);
+        queue.enqueueNDRangeKernel(value_fc1_kernel, cl::NullRange,
+                                   cl::NDRange(m_value_fc, batch_size));
+
+        value_fc2_kernel.setArg(0, bufferValue);
+        value_fc2_kernel.setArg(1, bufferOutput);
+        value_fc2_kernel.setArg(2, weights[6]);
+        value_fc2_kernel.setArg(3, weights[7]);
+        value_fc2_kernel.setArg(4, batch);
+        value_fc2_kernel.setArg(5, m_value_fc);
+        queue.enqueueNDRangeKernel(value_fc2_kernel, cl::NullRange,
+                                   cl::NDRange(batch_size));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in heads: " << e.what() << ": "
+            << e.err() << std::endl;
+        throw;
+    }
+}
+
+bool OpenCL_Network::use_winograd(unsigned int filter_size) const {
+    return filter_size == 3 && cfg_winograd;
+}
+
 void OpenCL_Network::convolve(int filter_size, int channels, int outputs,
+                              size_t batch_size,
+                              bool winograd,
                               cl::Buffer& bufferInput,
                               cl::Buffer& bufferOutput,
-                              cl::Buffer& bufferMerge,
+                              cl::Buffer* bufferResidual,
                               std::vector<cl::Buffer>& weights) {
-    // fixed for BOARD_SIZE*BOARD_SIZE
-    constexpr int width = BOARD_SIZE;
-    constexpr int height = BOARD_SIZE;
-    constexpr int boardsize = width * height;
-
-    cl::Kernel * m_convolve_kernel = nullptr;
-    if (filter_size == 3) {
-        m_convolve_kernel = &opencl_thread_data.m_convolve3_kernel;
-    } else {
-        assert(filter_size == 1);
-        m_convolve_kernel = &opencl_thread_data.m_convolve1_kernel;
-    }
-
-    // Input channel grouping
-    int channelGroup = 8;
-    int channelShift = 3;
-    // Input layer is not a multiple of 8
-    if (channels == 18) {
-        channelGroup = 2;
-        channelShift = 1;
+    if (winograd) {
+        convolve_winograd(channels, outputs, batch_size,
+                          bufferInput, bufferOutput, bufferResidual, weights);
+        return;
     }
 
-    constexpr int rowGroup = 1;
-    size_t outputGroup = std::min(outputs, 32);
-
-#ifndef NDEBUG
-    // Total output size after reducing
-    size_t outSize = width * height * outputs * sizeof(float);
+    auto& thread_data = m_opencl.get_thread_data();
+    cl::CommandQueue & queue = thread_data.m_commandqueue;
+    const auto& tuners = m_opencl.m_tuners;
 
-    // Produce channel * output planes and merge them at the end
-    size_t mergeSize = (channels >> channelShift) * outSize;
-#endif
-
-    // Copy the rows locally
-    size_t stripSize;
-    int rowTileSize;
-    int rowTiles;
-    if (filter_size == 3) {
-        stripSize = filter_size * (width + (filter_size - 1)) * sizeof(float);
-        rowTiles    =  cfg_rowtiles;
-        rowTileSize =  (BOARD_SIZE + rowTiles - 1) / rowTiles;
-    } else {
-        assert(filter_size == 1);
-        stripSize = width * sizeof(float);
-        rowTiles    = BOARD_SIZE;
-        rowTileSize =  1;
-        assert(channelGroup == 8); // hardcoded in kernel
+    // Outputs computed by a work group
+    int outputGroup = std::min(outputs, tuners.output_group);
+    while (outputs % outputGroup != 0) {
+        outputGroup /= 2;
     }
 
-    int rowBuffer = std::min<int>(channelGroup, 7);
-    size_t rowSize = channelGroup * outputGroup * rowBuffer * sizeof(float);
-
-    assert(mergeSize <= bufferMerge.getInfo<CL_MEM_SIZE>());
-
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
-
     try {
-        m_convolve_kernel->setArg(0, bufferInput);
-        m_convolve_kernel->setArg(1, bufferMerge);
-        m_convolve_kernel->setArg(2, weights[0]);
-        m_convolve_kernel->setArg(3, cl::Local(stripSize * channelGroup * rowGroup));
-        m_convolve_kernel->setArg(4, cl::Local(rowSize));
+        cl::Kernel * m_convolve_kernel = nullptr;
+        size_t rows;
         if (filter_size == 3) {
-            m_convolve_kernel->setArg(5, rowTileSize);
-            m_convolve_kernel->setArg(6, rowBuffer);
+            m_convolve_kernel = &thread_data.m_convolve3_kernel;
+            // Input channels copied locally at a time, the input layer
+            // has only 4
+            int channelGroup = tuners.channel_group;
+            while (channels % channelGroup != 0) {
+                channelGroup /= 2;
+            }
+            // ROW_TILE_SIZE in the kernel
+            const int rowTileSize = tuners.row_tile_size;
+            const size_t stripSize = (rowTileSize + filter_size - 1)
+                * (BOARD_SIZE + filter_size - 1) * sizeof(float);
+            rows = (BOARD_SIZE + rowTileSize - 1) / rowTileSize;
+            m_convolve_kernel->setArg(5, cl::Local(stripSize * channelGroup));
+            m_convolve_kernel->setArg(6, channels);
             m_convolve_kernel->setArg(7, channelGroup);
-            m_convolve_kernel->setArg(8, channelShift);
+        } else {
+            assert(filter_size == 1);
+            m_convolve_kernel = &thread_data.m_convolve1_kernel;
+            rows = BOARD_SIZE;
+            m_convolve_kernel->setArg(5, channels);
+        }
+        m_convolve_kernel->setArg(0, bufferInput);
+        m_convolve_kernel->setArg(1, bufferOutput);
+        m_convolve_kernel->setArg(2, weights[0]);
+        m_convolve_kernel->setArg(3, weights[1]);
+        if (bufferResidual) {
+            m_convolve_kernel->setArg(4, *bufferResidual);
+        } else {
+            m_convolve_kernel->setArg(4, nullptr);
         }
 
         queue.enqueueNDRangeKernel(*m_convolve_kernel, cl::NullRange,
-                                   cl::NDRange(channels, outputs, rowTiles),
-                                   cl::NDRange(channelGroup, outputGroup, rowGroup));
+                                   cl::NDRange(outputs, rows * batch_size),
+                                   cl::NDRange(outputGroup, 1));
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve: " << e.what() << ": "
 	        << e.err() << std::endl;
         throw;
     }
-
-    cl::Kernel & merge_kernel = opencl_thread_data.m_merge_kernel;
-    assert(channels % (1 << channelShift) == 0);
-
-    try {
-        merge_kernel.setArg(0, bufferMerge);
-        merge_kernel.setArg(1, bufferOutput);
-        merge_kernel.setArg(2, weights[1]);
-        merge_kernel.setArg(3, channels >> channelShift);
-
-        queue.enqueueNDRangeKernel(merge_kernel, cl::NullRange,
-                                   cl::NDRange(outputs, boardsize),
-                                   cl::NDRange(std::min(8, outputs), BOARD_SIZE));
-    } catch (const cl::Error &e) {
-        std::cerr << "Error in merge: " << e.what() << ": "
-	        << e.err() << std::endl;
-        throw;
-    }
 }
 
-void OpenCL_Network::batchnorm(int outputs,
-                               int channel_size,
-                               cl::Buffer& bufferInput,
-                               cl::Buffer& bufferOutput,
-                               cl::Buffer* bufferResidual,
-                               std::vector<cl::Buffer>& weights) {
-    cl::CommandQueue & queue = opencl_thread_data.m_commandqueue;
-
-    cl::Kernel & batchnorm_kernel = opencl_thread_data.m_batchnorm_kernel;
-
-    size_t channelGroup = 1;
-    if (channel_size == BOARD_SQUARE_SIZE) {
-        channelGroup = BOARD_SIZE;
-    }
+void OpenCL_Network::convolve_winograd(int channels, int outputs,
+                                       size_t batch_size,
+                                       cl::Buffer& bufferInput,
+                                       cl::Buffer& bufferOutput,
+                                       cl::Buffer* bufferResidual,
+                                       std::vector<cl::Buffer>& weights) {
+    auto& thread_data = m_opencl.get_thread_data();
+    cl::CommandQueue & queue = thread_data.m_commandqueue;
+    cl::Kernel & in_transform_kernel = thread_data.m_in_transform_kernel;
+    cl::Kernel & sgemm_kernel = thread_data.m_sgemm_kernel;
+    cl::Kernel & out_transform_kernel = thread_data.m_out_transform_kernel;
+    cl::Buffer & bufferV = thread_data.m_VBuffer;
+    cl::Buffer & bufferM = thread_data.m_MBuffer;
+
+    const int tiles = batch_size * WINOGRAD_P;
+    const int tileSize = m_opencl.m_tuners.winograd_ts;
+    const int tilesPerItem = m_opencl.m_tuners.winograd_vw;
+    auto round_up = [](int val, int multiple) {
+        return ((val + multiple - 1) / multiple) * multiple;
+    };
 
     try {
-        batchnorm_kernel.setArg(0, bufferInput);
-        batchnorm_kernel.setArg(1, bufferOutput);
+        in_transform_kernel.setArg(0, bufferInput);
+        in_transform_kernel.setArg(1, bufferV);
+        in_transform_kernel.setArg(2, int(batch_size));
+
+        queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
+                                   cl::NDRange(channels, tiles));
+
+        sgemm_kernel.setArg(0, weights[0]);
+        sgemm_kernel.setArg(1, bufferV);
+        sgemm_kernel.setArg(2, bufferM);
+        sgemm_kernel.setArg(3, outputs);
+        sgemm_kernel.setArg(4, channels);
+        sgemm_kernel.setArg(5, tiles);
+
+        queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
+                                   cl::NDRange(round_up(tiles, tileSize) / tilesPerItem,
+                                               round_up(outputs, tileSize),
+                                               WINOGRAD_TILE),
+                                   cl::NDRange(tileSize / tilesPerItem, tileSize, 1));
+
+        out_transform_kernel.setArg(0, bufferM);
+        out_transform_kernel.setArg(1, bufferOutput);
+        out_transform_kernel.setArg(2, weights[1]);
         if (bufferResidual) {
-            batchnorm_kernel.setArg(2, *bufferResidual);
+            out_transform_kernel.setArg(3, *bufferResidual);
         } else {
-            batchnorm_kernel.setArg(2, nullptr);
+            out_transform_kernel.setArg(3, nullptr);
         }
-        batchnorm_kernel.setArg(3, weights[0]);
-        batchnorm_kernel.setArg(4, weights[1]);
+        out_transform_kernel.setArg(4, int(batch_size));
 
-        queue.enqueueNDRangeKernel(batchnorm_kernel, cl::NullRange,
-                                   cl::NDRange(outputs, channel_size),
-                                   cl::NDRange(std::min(8, outputs), channelGroup));
+        queue.enqueueNDRangeKernel(out_transform_kernel, cl::NullRange,
+                                   cl::NDRange(outputs, tiles));
     } catch (const cl::Error &e) {
-        std::cerr << "Error in batchnorm: " << e.what() << ": "
+        std::cerr << "Error in convolve_winograd: " << e.what() << ": "
             << e.err() << std::endl;
         throw;
     }
@@ -654,7 +982,46 @@ static std::string trim(std::string trim_me) {
     return trim_me;
 }
 
-void OpenCL::initialize(void) {
+// Splits the CPU devices as cfg_cpu_subdevices says, other devices and
+// devices that can't be split are kept whole
+static std::vector<cl::Device> split_cpu_devices(
+    const std::vector<cl::Device>& devices) {
+    auto result = std::vector<cl::Device>{};
+    for (const auto& device : devices) {
+        if (cfg_cpu_subdevices == 0
+            || device.getInfo<CL_DEVICE_TYPE>() != CL_DEVICE_TYPE_CPU) {
+            result.push_back(device);
+            continue;
+        }
+        auto properties = std::vector<cl_device_partition_property>{};
+        if (cfg_cpu_subdevices < 0) {
+            properties = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                          CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+        } else {
+            auto units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            auto units_per_part = std::max(1u, units / cfg_cpu_subdevices);
+            properties = {CL_DEVICE_PARTITION_EQUALLY,
+                          cl_device_partition_property(units_per_part), 0};
+        }
+        auto subdevices = std::vector<cl::Device>{};
+        try {
+            device.createSubDevices(properties.data(), &subdevices);
+        } catch (const cl::Error &e) {
+            myprintf("Could not split %s: %s: %d\n",
+                     trim(device.getInfo<CL_DEVICE_NAME>()).c_str(),
+                     e.what(), e.err());
+            result.push_back(device);
+            continue;
+        }
+        myprintf("Split %s into %d sub-devices\n",
+                 trim(device.getInfo<CL_DEVICE_NAME>()).c_str(),
+                 subdevices.size());
+        result.insert(end(result), begin(subdevices), end(subdevices));
+    }
+    return result;
+}
+
+void OpenCLScheduler::initialize(int channels) {
     std::vector<cl::Platform> platforms;
     try {
         cl::Platform::get(&platforms);
@@ -663,13 +1030,11 @@ void OpenCL::initialize(void) {
         throw;
     }
 
-    float best_version = 0.0f;
-    cl::Platform best_platform;
-    cl::Device best_device;
-    std::string best_vendor;
+    // All devices by ID
+    std::vector<cl::Device> all_devices;
+    size_t best_id = 0;
     int best_score = 0;
     bool found_device = false;
-    int id = 0;
 
     myprintf("Detected %d OpenCL platforms\n", platforms.size());
 
@@ -696,7 +1061,7 @@ void OpenCL::initialize(void) {
             devices.clear();
         }
         for (auto& d : devices) {
-            myprintf("Device ID:     %d\n", id);
+            myprintf("Device ID:     %d\n", all_devices.size());
             myprintf("Device name:   %s\n",
                      trim(d.getInfo<CL_DEVICE_NAME>()).c_str());
             myprintf("Device type:   %s\n",
@@ -721,93 +1086,260 @@ void OpenCL::initialize(void) {
             this_score +=  opencl_version * 10;
             myprintf("Device score:  %d\n", this_score);
 
-            bool preferred = std::find(cfg_gpus.cbegin(), cfg_gpus.cend(), id) != cfg_gpus.cend();
-
-            if ((this_score > best_score) || preferred) {
-                best_version = opencl_version;
-                best_platform = p;
-                best_device = d;
-                if (preferred) {
-                    best_score = std::numeric_limits<decltype(best_score)>::max();
-                } else {
-                    best_score = this_score;
-                }
+            if (this_score > best_score) {
+                best_id = all_devices.size();
+                best_score = this_score;
                 found_device = true;
             }
-            id++;
+            all_devices.push_back(d);
         }
     }
 
-    if (!found_device) {
+    // Every device listed in cfg_gpus gets a replica, without the list
+    // only the best one does
+    std::vector<cl::Device> selected;
+    if (cfg_gpus.empty()) {
+        if (found_device) {
+            selected.push_back(all_devices[best_id]);
+        }
+    } else {
+        for (auto id : cfg_gpus) {
+            if (id >= 0 && size_t(id) < all_devices.size()) {
+                selected.push_back(all_devices[id]);
+            } else {
+                myprintf("No OpenCL device with ID %d\n", id);
+            }
+        }
+    }
+    if (selected.empty()) {
         throw std::runtime_error("No suitable OpenCL device found.");
     }
+    selected = split_cpu_devices(selected);
+
+    // Tune for the batches the evaluation queue will hand the devices
+    const auto batch_size = Network::get_queue_batch_size(selected.size());
+    for (const auto& device : selected) {
+        m_opencl.emplace_back(std::make_unique<OpenCL>());
+        m_opencl.back()->initialize(channels, batch_size, device,
+                                    m_opencl.size() - 1);
+    }
+}
 
-    cl::Platform::setDefault(best_platform);
-    myprintf("Selected platform: %s\n", best_platform.getInfo<CL_PLATFORM_NAME>().c_str());
-    myprintf("Selected device: %s\n", trim(best_device.getInfo<CL_DEVICE_NAME>()).c_str());
-    myprintf("with OpenCL %2.1f capability\n", best_version);
+void OpenCLScheduler::forward(OpenCLReplicas& replicas,
+                              const aligned_uint64_vector& input,
+                              aligned_vector& policy,
+                              aligned_vector& winrate,
+                              size_t batch_size) {
+    // Hand out the devices round robin to the evaluating threads
+    static thread_local size_t s_device = m_next_device++;
+    replicas.get_network(s_device % m_opencl.size()).forward(
+        input, policy, winrate, batch_size);
+}
+
+OpenCLReplicas::OpenCLReplicas(
+    const std::vector<std::unique_ptr<OpenCL>>& devices) {
+    for (const auto& device : devices) {
+        m_networks.emplace_back(std::make_unique<OpenCL_Network>(*device));
+    }
+}
+
+void OpenCLReplicas::push_convolve(unsigned int filter_size,
+                                   const std::vector<float> & weights,
+                                   const std::vector<float> & biases) {
+    for (auto& network : m_networks) {
+        network->push_convolve(filter_size, weights, biases);
+    }
+}
+
+void OpenCLReplicas::push_residual(unsigned int filter_size,
+                                   const std::vector<float> & weights_1,
+                                   const std::vector<float> & biases_1,
+                                   const std::vector<float> & weights_2,
+                                   const std::vector<float> & biases_2) {
+    for (auto& network : m_networks) {
+        network->push_residual(filter_size, weights_1, biases_1,
+                               weights_2, biases_2);
+    }
+}
+
+void OpenCLReplicas::push_heads(const std::vector<float> & conv_w,
+                                const std::vector<float> & conv_b,
+                                const std::vector<float> & policy_w,
+                                const std::vector<float> & policy_b,
+                                const std::vector<float> & value1_w,
+                                const std::vector<float> & value1_b,
+                                const std::vector<float> & value2_w,
+                                const std::vector<float> & value2_b) {
+    for (auto& network : m_networks) {
+        network->push_heads(conv_w, conv_b, policy_w, policy_b,
+                            value1_w, value1_b, value2_w, value2_b);
+    }
+}
+
+void OpenCL::initialize(int channels, int batch_size,
+                        const cl::Device& device, size_t index) {
+    m_device = device;
+    m_index = index;
+    myprintf("Initializing OpenCL device %d: %s\n", index,
+             trim(m_device.getInfo<CL_DEVICE_NAME>()).c_str());
 
-    cl::Context context;
     try {
-        context = cl::Context(best_device);
+        m_context = cl::Context(m_device);
     } catch (const cl::Error &e) {
         myprintf("Error creating OpenCL context: %s: %d", e.what(), e.err());
         throw;
     }
-    cl::Context::setDefault(context);
-    cl::Device::setDefault(best_device);
 
-    // Read source file
-    //std::ifstream sourceFile("convolve_kernel.cl", std::ifstream::in);
-    //std::string sourceCode(std::istreambuf_iterator<char>(sourceFile),
-    //                       (std::istreambuf_iterator<char>()));
+    m_max_workgroup_size = m_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    m_max_workgroup_dims = m_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+    myprintf("Max workgroup size: %d\n", m_max_workgroup_size);
+    myprintf("Max workgroup dimensions: ");
+    for (auto d : m_max_workgroup_dims) {
+        myprintf("%d ", d);
+    }
+    myprintf("\n");
+
+    m_tuners.row_tile_size = (BOARD_SIZE + cfg_rowtiles - 1) / cfg_rowtiles;
+#ifdef USE_TUNER
+    auto tuner = Tuner(*this, m_context, m_device);
+    m_tuners = tuner.load_tuners(channels, batch_size, m_tuners);
+#endif
+
+    m_program = load_program(m_tuners);
+
+    m_wavefront_size =
+        get_thread_data().m_convolve3_kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
+            m_device);
+    myprintf("Wavefront/Warp size: %d\n", m_wavefront_size);
+
+    m_init_ok = true;
+}
+
+static std::string get_program_source(void) {
+    return sourceCode_config
+           + sourceCode_convolve1
+           + sourceCode_convolve3
+           + sourceCode_input
+           + sourceCode_heads
+           + sourceCode_winograd;
+}
 
+static std::string get_build_options(const Tuners& tuners) {
+    auto args = std::string{"-cl-mad-enable -cl-fast-relaxed-math "
+                            "-cl-no-signed-zeros -cl-denorms-are-zero"};
+    args += get_build_defines(tuners);
+    if (cfg_half_weights) {
+        args += " -DUSE_HALF";
+    }
+    return args;
+}
+
+cl::Program OpenCL::build_program(const Tuners& tuners) const {
     // Make program of the source code in the context
+    cl::Program program;
     try {
-        m_program = cl::Program(sourceCode_convolve1
-                                + sourceCode_convolve3
-                                + sourceCode_utility);
+        program = cl::Program(m_context, get_program_source());
     } catch (const cl::Error &e) {
         myprintf("Error getting kernels: %s: %d", e.what(), e.err());
         throw;
     }
     // Build program for these specific devices
     try {
-        m_program.build("-cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros -cl-denorms-are-zero");
+        program.build(get_build_options(tuners).c_str());
     } catch (const cl::Error&) {
         myprintf("Error building kernels: %s\n",
-                    m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(cl::Device::getDefault()).c_str());
+                    program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device).c_str());
         throw;
     }
+    return program;
+}
 
-    ensure_thread_initialized();
-
-    m_wavefront_size =
-        opencl_thread_data.m_convolve3_kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
-            best_device);
-    myprintf("Wavefront/Warp size: %d\n", m_wavefront_size);
+// 64 bit FNV-1a, stable between runs and compilers unlike std::hash
+static std::uint64_t fnv1a_hash(const std::string& str) {
+    auto hash = std::uint64_t{14695981039346656037ULL};
+    for (auto c : str) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    m_max_workgroup_size = best_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-    m_max_workgroup_dims = best_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+std::string OpenCL::get_program_cache_file(const Tuners& tuners) const {
+    auto platform = cl::Platform(m_device.getInfo<CL_DEVICE_PLATFORM>());
+    auto key = std::stringstream{};
+    key << get_program_source() << '\n'
+        << get_build_options(tuners) << '\n'
+        << platform.getInfo<CL_PLATFORM_VERSION>() << '\n'
+        << m_device.getInfo<CL_DEVICE_VENDOR>() << '\n'
+        << m_device.getInfo<CL_DEVICE_NAME>() << '\n'
+        << m_device.getInfo<CL_DEVICE_VERSION>() << '\n'
+        << m_device.getInfo<CL_DRIVER_VERSION>();
+    auto file = std::stringstream{};
+    file << PROGRAM_CACHE_PREFIX << std::hex << std::setw(16)
+         << std::setfill('0') << fnv1a_hash(key.str());
+    return file.str();
+}
 
-    myprintf("Max workgroup size: %d\n", m_max_workgroup_size);
-    myprintf("Max workgroup dimensions: ");
-    for (auto d : m_max_workgroup_dims) {
-        myprintf("%d ", d);
+cl::Program OpenCL::load_program(const Tuners& tuners) const {
+    if (!cfg_kernel_cache) {
+        return build_program(tuners);
+    }
+    const auto filename = get_program_cache_file(tuners);
+
+    auto file = std::ifstream{filename, std::ios::binary};
+    if (file) {
+        auto binary = std::vector<unsigned char>(
+            std::istreambuf_iterator<char>{file},
+            std::istreambuf_iterator<char>{});
+        file.close();
+        // A binary the driver no longer accepts is rebuilt from source
+        try {
+            auto program = cl::Program(m_context, {m_device},
+                                       cl::Program::Binaries{binary});
+            program.build(get_build_options(tuners).c_str());
+            myprintf("Loaded the kernels from %s\n", filename.c_str());
+            return program;
+        } catch (const cl::Error &e) {
+            myprintf("Stale kernel cache %s: %s: %d\n",
+                     filename.c_str(), e.what(), e.err());
+            std::remove(filename.c_str());
+        }
     }
-    myprintf("\n");
 
-    m_init_ok = true;
+    auto program = build_program(tuners);
+
+    // Write to a temporary file first, several processes starting at
+    // once must not see a partial binary
+    try {
+        auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+        if (binaries.size() != 1 || binaries.front().empty()) {
+            return program;
+        }
+        const auto tmpname = filename + "."
+            + std::to_string(std::random_device{}());
+        auto out = std::ofstream{tmpname, std::ios::binary};
+        out.write(reinterpret_cast<const char*>(binaries.front().data()),
+                  binaries.front().size());
+        out.close();
+        if (!out || std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+            myprintf("Could not save the kernels to %s\n", filename.c_str());
+            std::remove(tmpname.c_str());
+        }
+    } catch (const cl::Error &e) {
+        myprintf("Could not get the kernel binary: %s: %d\n",
+                 e.what(), e.err());
+    }
+    return program;
 }
 
 std::string OpenCL::get_device_name() {
     std::stringstream ss;
 
-    cl::Device device = cl::Device::getDefault();
     ss << "OpenCL: ";
-    ss << device.getInfo<CL_DEVICE_VENDOR>() << " ";
-    ss << device.getInfo<CL_DEVICE_NAME>() << " @ ";
-    ss << device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>() << "MHz";
+    ss << m_device.getInfo<CL_DEVICE_VENDOR>() << " ";
+    ss << m_device.getInfo<CL_DEVICE_NAME>() << " @ ";
+    ss << m_device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>() << "MHz";
 
     return ss.str();
 }
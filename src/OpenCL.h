@@ -26,18 +26,47 @@
 #define CL_HPP_ENABLE_EXCEPTIONS
 #include <CL/cl2.hpp>
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "Winograd.h"
+
+// Store the convolution filters as fp16 on the device, halving the
+// memory traffic of the filter loads. Arithmetic stays fp32.
+extern bool cfg_half_weights;
+// Split CPU devices into sub-devices, each with its own replica of the
+// network: 0 = don't, -1 = one per NUMA node, n = n equal parts
+extern int cfg_cpu_subdevices;
+// Store the compiled kernels on disk and reuse them on the next start
+extern bool cfg_kernel_cache;
+
+class OpenCL;
+
+// Work group and tile sizes of the convolution kernels, picked for
+// the device by the Tuner
+struct Tuners {
+    // Winograd sgemm: tile edge and tiles computed per work item
+    int winograd_ts{8};
+    int winograd_vw{1};
+    // Direct convolution: rows per work item, input channels copied
+    // to local memory at a time and outputs per work group
+    int row_tile_size{2};
+    int channel_group{8};
+    int output_group{32};
+};
+
 class Layer {
     friend class OpenCL_Network;
 private:
     unsigned int channels{0};
     unsigned int outputs{0};
     unsigned int filter_size{0};
-    bool is_batchnorm{false};
     bool is_innerproduct{false};
     bool is_residual_block{false};
+    // 3x3 filters are stored Winograd transformed
+    bool is_winograd{false};
     std::vector<cl::Buffer> weights;
 };
 
@@ -49,99 +78,171 @@ private:
     cl::CommandQueue m_commandqueue;
     cl::Kernel m_convolve1_kernel;
     cl::Kernel m_convolve3_kernel;
-    cl::Kernel m_merge_kernel;
-    cl::Kernel m_batchnorm_kernel;
+    cl::Kernel m_expand_input_kernel;
+    cl::Kernel m_head_convolve_kernel;
+    cl::Kernel m_policy_fc_kernel;
+    cl::Kernel m_softmax_kernel;
+    cl::Kernel m_value_fc1_kernel;
+    cl::Kernel m_value_fc2_kernel;
+    cl::Kernel m_in_transform_kernel;
+    cl::Kernel m_sgemm_kernel;
+    cl::Kernel m_out_transform_kernel;
+    // Bit packed input planes
+    cl::Buffer m_maskBuffer;
     cl::Buffer m_inBuffer;
     cl::Buffer m_tmpBuffer;
-    cl::Buffer m_mergeBuffer;
     cl::Buffer m_outBuffer;
     cl::Buffer m_residualBuffer;
-    bool m_buffers_allocated{false};
+    cl::Buffer m_VBuffer;
+    cl::Buffer m_MBuffer;
+    // Heads: 1x1 convolution output, policy logits, value FC output
+    cl::Buffer m_headBuffer;
+    cl::Buffer m_logitsBuffer;
+    cl::Buffer m_valueBuffer;
+    // Buffers are sized for this many positions, tower and value
+    // head widths
+    size_t m_batch_size{0};
+    size_t m_channels{0};
+    size_t m_value_fc{0};
 };
 
 class OpenCL_Network {
 public:
-    void push_batchnorm(unsigned int spatial_size,
-                        const std::vector<float> & means,
-                        const std::vector<float> & variances) {
-        size_t layer = get_layer_count();
-        push_weights(layer, means);
-        push_weights(layer, variances);
-        m_layers[layer].is_batchnorm = true;
-        m_layers[layer].channels = means.size();
-        m_layers[layer].outputs = means.size();
-        m_layers[layer].filter_size = spatial_size;
-    }
+    explicit OpenCL_Network(OpenCL & opencl) : m_opencl(opencl) {}
 
     void push_convolve(unsigned int filter_size,
                        const std::vector<float> & weights,
                        const std::vector<float> & biases) {
         size_t layer = get_layer_count();
-        push_weights(layer, weights);
+        auto outputs = biases.size();
+        auto channels = weights.size() / (outputs * filter_size * filter_size);
+        auto winograd = use_winograd(filter_size);
+        if (winograd) {
+            push_filter(layer, winograd_transform_f(weights, outputs, channels));
+        } else {
+            push_filter(layer, weights);
+        }
         push_weights(layer, biases);
-        m_layers[layer].outputs = biases.size();
+        m_layers[layer].outputs = outputs;
         m_layers[layer].filter_size = filter_size;
-        m_layers[layer].channels = weights.size()
-            / (biases.size() * filter_size * filter_size);
+        m_layers[layer].channels = channels;
+        m_layers[layer].is_winograd = winograd;
     }
 
     void push_residual(unsigned int filter_size,
                        const std::vector<float> & weights_1,
                        const std::vector<float> & biases_1,
-                       const std::vector<float> & means_1,
-                       const std::vector<float> & variances_1,
                        const std::vector<float> & weights_2,
-                       const std::vector<float> & biases_2,
-                       const std::vector<float> & means_2,
-                       const std::vector<float> & variances_2) {
+                       const std::vector<float> & biases_2) {
         size_t layer = get_layer_count();
-        push_weights(layer, weights_1);
+        auto outputs = biases_1.size();
+        auto channels = weights_1.size()
+            / (outputs * filter_size * filter_size);
+        auto winograd = use_winograd(filter_size);
+        if (winograd) {
+            push_filter(layer, winograd_transform_f(weights_1, outputs, channels));
+        } else {
+            push_filter(layer, weights_1);
+        }
         push_weights(layer, biases_1);
-        push_weights(layer, means_1);
-        push_weights(layer, variances_1);
-        push_weights(layer, weights_2);
+        if (winograd) {
+            push_filter(layer, winograd_transform_f(weights_2, outputs, channels));
+        } else {
+            push_filter(layer, weights_2);
+        }
         push_weights(layer, biases_2);
-        push_weights(layer, means_2);
-        push_weights(layer, variances_2);
         m_layers[layer].is_residual_block = true;
-        m_layers[layer].outputs = biases_1.size();
+        m_layers[layer].outputs = outputs;
         m_layers[layer].filter_size = filter_size;
-        m_layers[layer].channels = weights_1.size()
-            / (biases_1.size() * filter_size * filter_size);
+        m_layers[layer].channels = channels;
+        m_layers[layer].is_winograd = winograd;
     }
 
+    // Policy and value heads, with their 1x1 convolutions merged into
+    // one of Network::HEAD_PLANES outputs
+    void push_heads(const std::vector<float> & conv_w,
+                    const std::vector<float> & conv_b,
+                    const std::vector<float> & policy_w,
+                    const std::vector<float> & policy_b,
+                    const std::vector<float> & value1_w,
+                    const std::vector<float> & value1_b,
+                    const std::vector<float> & value2_w,
+                    const std::vector<float> & value2_b);
+
     size_t get_layer_count() const {
         return m_layers.size();
     }
+    // Widest layer input or output
+    size_t get_max_channels() const;
 
-    void forward(const std::vector<net_t>& input, std::vector<net_t>& output);
+    // input holds one bit mask per input plane, [batch_size][channels],
+    // which is expanded to floats on the device.
+    // Returns the move probabilities ([batch_size][BOARD_ACTION_N])
+    // and the winrates, which is all that is read back from the device.
+    void forward(const aligned_uint64_vector& input,
+                 aligned_vector& policy,
+                 aligned_vector& winrate,
+                 size_t batch_size = 1);
 
 private:
     void push_weights(size_t layer, const std::vector<float> & weights) {
         add_weights(layer, weights.size(), weights.data());
     }
     void add_weights(size_t layer, size_t size, const float * weights);
+    // Convolution filters, stored as half with cfg_half_weights
+    void push_filter(size_t layer, const std::vector<float> & weights);
+    bool use_winograd(unsigned int filter_size) const;
     void convolve(int filter_size, int channels, int outputs,
-                  cl::Buffer& input, cl::Buffer& output, cl::Buffer& merge,
+                  size_t batch_size,
+                  bool winograd,
+                  cl::Buffer& input, cl::Buffer& output,
+                  cl::Buffer* residual,
                   std::vector<cl::Buffer>& weights);
-    void batchnorm(int outputs, int channel_size, cl::Buffer& input,
-                   cl::Buffer& output, cl::Buffer* residual,
-                   std::vector<cl::Buffer>& weights);
-    void innerproduct(int inputs, int outputs,
-                      cl::Buffer& input, cl::Buffer& output,
-                      std::vector<cl::Buffer>& weights);
+    void convolve_winograd(int channels, int outputs,
+                           size_t batch_size,
+                           cl::Buffer& input,
+                           cl::Buffer& output,
+                           cl::Buffer* residual,
+                           std::vector<cl::Buffer>& weights);
+    void heads(size_t batch_size, cl::Buffer& input, cl::Buffer& output);
+    OpenCL & m_opencl;
     std::vector<Layer> m_layers;
+    std::vector<cl::Buffer> m_head_weights;
+    // Outputs of the first value head inner product
+    int m_value_fc{0};
 };
 
+// One device with its own context and kernels
 class OpenCL {
     friend class OpenCL_Network;
 public:
-    void initialize();
-    void ensure_thread_initialized(void);
+    // The kernels are tuned for a tower of this many channels and
+    // batches of batch_size, but run any width and batch. index tells
+    // the devices apart in the per thread data.
+    void initialize(int channels, int batch_size,
+                    const cl::Device& device, size_t index);
+    // The kernels and buffers of the calling thread for this device
+    ThreadData& get_thread_data(void);
     std::string get_device_name();
 
+    // Builds the kernels with the board and tile sizes baked in
+    cl::Program build_program(const Tuners& tuners) const;
+    // Same as build_program, but reuses the binary of an earlier run
+    // with the same source, options and driver when there is one
+    cl::Program load_program(const Tuners& tuners) const;
+
+    size_t get_max_workgroup_size() const {
+        return m_max_workgroup_size;
+    }
+
 private:
+    std::string get_program_cache_file(const Tuners& tuners) const;
+
+    cl::Context m_context;
+    cl::Device m_device;
+    size_t m_index{0};
     cl::Program m_program;
+    Tuners m_tuners;
 
     size_t m_wavefront_size{0};
     size_t m_max_workgroup_size{0};
@@ -149,8 +250,70 @@ private:
     bool m_init_ok{false};
 };
 
-extern OpenCL opencl;
-extern OpenCL_Network opencl_net;
-extern thread_local ThreadData opencl_thread_data;
+/*
+    One network with a copy on every device of the scheduler. Loading
+    a new network creates a new set of copies, while the devices with
+    their programs, tuning and per-thread data stay.
+*/
+class OpenCLReplicas {
+public:
+    explicit OpenCLReplicas(const std::vector<std::unique_ptr<OpenCL>>& devices);
+
+    void push_convolve(unsigned int filter_size,
+                       const std::vector<float> & weights,
+                       const std::vector<float> & biases);
+    void push_residual(unsigned int filter_size,
+                       const std::vector<float> & weights_1,
+                       const std::vector<float> & biases_1,
+                       const std::vector<float> & weights_2,
+                       const std::vector<float> & biases_2);
+    void push_heads(const std::vector<float> & conv_w,
+                    const std::vector<float> & conv_b,
+                    const std::vector<float> & policy_w,
+                    const std::vector<float> & policy_b,
+                    const std::vector<float> & value1_w,
+                    const std::vector<float> & value1_b,
+                    const std::vector<float> & value2_w,
+                    const std::vector<float> & value2_b);
+
+    OpenCL_Network& get_network(size_t device) {
+        return *m_networks[device];
+    }
+
+private:
+    std::vector<std::unique_ptr<OpenCL_Network>> m_networks;
+};
+
+/*
+    Holds every device in cfg_gpus (or the best device) and spreads the
+    evaluations over them. A thread sticks to the device it was first
+    given, so its buffers exist only there.
+*/
+class OpenCLScheduler {
+public:
+    void initialize(int channels);
+
+    // An empty network on every device, filled with its push_* methods
+    std::unique_ptr<OpenCLReplicas> create_replicas() const {
+        return std::make_unique<OpenCLReplicas>(m_opencl);
+    }
+
+    // See OpenCL_Network::forward
+    void forward(OpenCLReplicas& replicas,
+                 const aligned_uint64_vector& input,
+                 aligned_vector& policy,
+                 aligned_vector& winrate,
+                 size_t batch_size = 1);
+
+    size_t get_device_count() const {
+        return m_opencl.size();
+    }
+
+private:
+    std::vector<std::unique_ptr<OpenCL>> m_opencl;
+    std::atomic<size_t> m_next_device{0};
+};
+
+extern OpenCLScheduler opencl;
 
 #endif
@@ -0,0 +1,309 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QUANTIZE_H_INCLUDED
+#define QUANTIZE_H_INCLUDED
+
+#include "config.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "Workspace.h"
+
+/*
+    Int8 3x3 convolution for the residual tower.
+
+    Weights are quantized symmetrically per output channel to
+    [-QUANT_WEIGHT_MAX, QUANT_WEIGHT_MAX] and activations per board to
+    [0, QUANT_INPUT_MAX], which is enough since every convolution input
+    has been through a ReLU. The activation scale is per board, so a
+    position gets the same result whatever it is batched with. VNNI accumulates in 32 bits. Plain AVX2
+    goes through the 16 bit sums of _mm256_maddubs_epi16, so 7 bit
+    activations and 6 bit weights let two of those be added before
+    widening without saturating.
+
+    The input is converted to zero padded [batch][H+2][W+2][channels]
+    and the weights are ordered [ky][kx][channels], so that every row of a
+    3x3 patch is a contiguous run of 3 * channels bytes and no im2col
+    copy is needed.
+*/
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+#define QUANT_USE_VNNI
+#endif
+
+// Channels must come in whole 256-bit vectors
+constexpr int QUANT_CHANNEL_ALIGN = 32;
+#ifdef QUANT_USE_VNNI
+constexpr float QUANT_WEIGHT_MAX = 127.0f;
+constexpr float QUANT_INPUT_MAX = 255.0f;
+#else
+constexpr float QUANT_WEIGHT_MAX = 63.0f;
+constexpr float QUANT_INPUT_MAX = 127.0f;
+#endif
+
+struct QuantizedFilter {
+    int outputs{0};
+    int channels{0};
+    // [outputs][3][3][channels]
+    aligned_int8_vector weights;
+    // Weight = weights * scales[output]
+    std::vector<float> scales;
+};
+
+// Outputs are computed 4 at a time
+inline bool can_quantize(int channels, int outputs) {
+    return channels % QUANT_CHANNEL_ALIGN == 0 && outputs % 4 == 0;
+}
+
+// f is [outputs][channels][3][3]
+inline QuantizedFilter quantize_filter(const std::vector<float>& f,
+                                       int outputs) {
+    auto q = QuantizedFilter{};
+    const int k_len = f.size() / outputs;
+    q.outputs = outputs;
+    q.channels = k_len / 9;
+    assert(can_quantize(q.channels, outputs));
+    q.weights.resize(outputs * k_len);
+    q.scales.resize(outputs);
+
+    for (int o = 0; o < outputs; o++) {
+        const float * row = &f[o * k_len];
+        float max_abs = 0.0f;
+        for (int k = 0; k < k_len; k++) {
+            max_abs = std::max(max_abs, std::fabs(row[k]));
+        }
+        const float scale = max_abs > 0.0f ? max_abs / QUANT_WEIGHT_MAX : 1.0f;
+        for (int c = 0; c < q.channels; c++) {
+            for (int k = 0; k < 9; k++) {
+                q.weights[(o * 9 + k) * q.channels + c] =
+                    int8_t(std::lround(row[c * 9 + k] / scale));
+            }
+        }
+        q.scales[o] = scale;
+    }
+    return q;
+}
+
+// Quantizes input ([channels][batch_size][BOARD_SQUARE_SIZE], >= 0)
+// into zero padded [batch_size][H+2][W+2][channels], with the scale of
+// board n in scales[n].
+inline void quantize_input(const aligned_vector& input,
+                           int channels, int batch_size,
+                           aligned_uint8_vector& qinput,
+                           aligned_vector& scales) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    constexpr int PW = W + 2;
+    constexpr int PH = H + 2;
+
+    qinput.resize(batch_size * PH * PW * channels);
+    scales.resize(batch_size);
+    for (int n = 0; n < batch_size; n++) {
+        float max_val = 0.0f;
+        for (int c = 0; c < channels; c++) {
+            const float * plane = &input[(c * batch_size + n) * W * H];
+            for (int i = 0; i < W * H; i++) {
+                max_val = std::max(max_val, plane[i]);
+            }
+        }
+        const float scale = max_val > 0.0f ? max_val / QUANT_INPUT_MAX : 1.0f;
+        const float inv_scale = 1.0f / scale;
+        scales[n] = scale;
+
+        uint8_t * board = &qinput[n * PH * PW * channels];
+        std::fill(board, board + PW * channels, 0);
+        std::fill(board + (PH - 1) * PW * channels,
+                  board + PH * PW * channels, 0);
+        for (int y = 1; y < PH - 1; y++) {
+            std::fill(board + (y * PW) * channels,
+                      board + (y * PW + 1) * channels, 0);
+            std::fill(board + (y * PW + PW - 1) * channels,
+                      board + (y * PW + PW) * channels, 0);
+        }
+        for (int c = 0; c < channels; c++) {
+            const float * plane = &input[(c * batch_size + n) * W * H];
+            for (int y = 0; y < H; y++) {
+                for (int x = 0; x < W; x++) {
+                    board[((y + 1) * PW + x + 1) * channels + c] =
+                        uint8_t(plane[y * W + x] * inv_scale + 0.5f);
+                }
+            }
+        }
+    }
+}
+
+#ifdef __AVX2__
+inline int32_t hsum_epi32(__m256i v) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                                _mm256_extracti128_si256(v, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    return _mm_cvtsi128_si32(sum);
+}
+
+// sum += a (u8) x b (s8), summed in groups of 4
+inline __m256i dot_u8s8_epi32(__m256i sum, __m256i a, __m256i b) {
+#if defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(sum, a, b);
+#elif defined(QUANT_USE_VNNI)
+    return _mm256_dpbusd_epi32(sum, a, b);
+#else
+    const __m256i ones = _mm256_set1_epi16(1);
+    return _mm256_add_epi32(sum,
+        _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), ones));
+#endif
+}
+
+// sum += a0 x b0 + a1 x b1, the 16 bit products are added before widening
+inline __m256i dot2_u8s8_epi32(__m256i sum, __m256i a0, __m256i b0,
+                               __m256i a1, __m256i b1) {
+#ifdef QUANT_USE_VNNI
+    return dot_u8s8_epi32(dot_u8s8_epi32(sum, a0, b0), a1, b1);
+#else
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i prod = _mm256_add_epi16(_mm256_maddubs_epi16(a0, b0),
+                                          _mm256_maddubs_epi16(a1, b1));
+    return _mm256_add_epi32(sum, _mm256_madd_epi16(prod, ones));
+#endif
+}
+#endif
+
+// acc[j][i] = 3x3 patch at square (y, x + i) of board n x weights of
+// output o + j. x must be even.
+inline void quantized_dot_4x2(const QuantizedFilter& q,
+                              const aligned_uint8_vector& qinput,
+                              int n, int y, int x, int o,
+                              int32_t acc[4][2]) {
+    constexpr int PW = BOARD_SIZE + 2;
+    constexpr int PH = BOARD_SIZE + 2;
+    const int channels = q.channels;
+    const int row_len = 3 * channels;
+    const int k_size = 9 * channels;
+    const int8_t * w = &q.weights[o * k_size];
+#ifdef __AVX2__
+    __m256i sum[4][2];
+    for (int j = 0; j < 4; j++) {
+        sum[j][0] = _mm256_setzero_si256();
+        sum[j][1] = _mm256_setzero_si256();
+    }
+    for (int ky = 0; ky < 3; ky++) {
+        const uint8_t * x0 = &qinput[((n * PH + y + ky) * PW + x) * channels];
+        const uint8_t * x1 = x0 + channels;
+        const int8_t * wy = w + ky * row_len;
+        int k = 0;
+        for (; k + 2 * QUANT_CHANNEL_ALIGN <= row_len;
+               k += 2 * QUANT_CHANNEL_ALIGN) {
+            const int k2 = k + QUANT_CHANNEL_ALIGN;
+            const __m256i a0 = _mm256_load_si256((const __m256i*)(x0 + k));
+            const __m256i a1 = _mm256_load_si256((const __m256i*)(x1 + k));
+            const __m256i c0 = _mm256_load_si256((const __m256i*)(x0 + k2));
+            const __m256i c1 = _mm256_load_si256((const __m256i*)(x1 + k2));
+            for (int j = 0; j < 4; j++) {
+                const __m256i b = _mm256_load_si256(
+                    (const __m256i*)(wy + j * k_size + k));
+                const __m256i d = _mm256_load_si256(
+                    (const __m256i*)(wy + j * k_size + k2));
+                sum[j][0] = dot2_u8s8_epi32(sum[j][0], a0, b, c0, d);
+                sum[j][1] = dot2_u8s8_epi32(sum[j][1], a1, b, c1, d);
+            }
+        }
+        for (; k < row_len; k += QUANT_CHANNEL_ALIGN) {
+            const __m256i a0 = _mm256_load_si256((const __m256i*)(x0 + k));
+            const __m256i a1 = _mm256_load_si256((const __m256i*)(x1 + k));
+            for (int j = 0; j < 4; j++) {
+                const __m256i b = _mm256_load_si256(
+                    (const __m256i*)(wy + j * k_size + k));
+                sum[j][0] = dot_u8s8_epi32(sum[j][0], a0, b);
+                sum[j][1] = dot_u8s8_epi32(sum[j][1], a1, b);
+            }
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        acc[j][0] = hsum_epi32(sum[j][0]);
+        acc[j][1] = hsum_epi32(sum[j][1]);
+    }
+#else
+    for (int j = 0; j < 4; j++) {
+        int32_t sum0 = 0;
+        int32_t sum1 = 0;
+        for (int ky = 0; ky < 3; ky++) {
+            const uint8_t * x0 = &qinput[((n * PH + y + ky) * PW + x) * channels];
+            const uint8_t * x1 = x0 + channels;
+            const int8_t * wy = w + j * k_size + ky * row_len;
+            for (int k = 0; k < row_len; k++) {
+                sum0 += int32_t(x0[k]) * wy[k];
+                sum1 += int32_t(x1[k]) * wy[k];
+            }
+        }
+        acc[j][0] = sum0;
+        acc[j][1] = sum1;
+    }
+#endif
+}
+
+// 3x3 convolution + bias + (optional) residual eltwise add + ReLU.
+// input, output and eltwise are [channels][batch_size][BOARD_SQUARE_SIZE]
+inline void quantized_convolve3(const QuantizedFilter& q,
+                                int batch_size,
+                                const aligned_vector& input,
+                                const std::vector<float>& biases,
+                                aligned_vector& output,
+                                const float * eltwise,
+                                aligned_uint8_vector& qinput,
+                                aligned_vector& input_scales) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    static_assert(W % 2 == 0, "squares are processed in pairs");
+    const int outputs = q.outputs;
+    assert(outputs % 4 == 0);
+    assert(output.size() >= size_t(outputs * batch_size * W * H));
+
+    quantize_input(input, q.channels, batch_size, qinput, input_scales);
+
+    int32_t acc[4][2];
+    for (int n = 0; n < batch_size; n++) {
+        const float input_scale = input_scales[n];
+        for (int y = 0; y < H; y++) {
+            for (int x = 0; x < W; x += 2) {
+                for (int o = 0; o < outputs; o += 4) {
+                    quantized_dot_4x2(q, qinput, n, y, x, o, acc);
+                    for (int j = 0; j < 4; j++) {
+                        const float scale = q.scales[o + j] * input_scale;
+                        const int base = ((o + j) * batch_size + n) * W * H
+                                         + y * W + x;
+                        for (int i = 0; i < 2; i++) {
+                            float val = acc[j][i] * scale + biases[o + j];
+                            if (eltwise) {
+                                val += eltwise[base + i];
+                            }
+                            output[base + i] = val > 0.0f ? val : 0.0f;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
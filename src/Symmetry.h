@@ -0,0 +1,136 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMMETRY_H_INCLUDED
+#define SYMMETRY_H_INCLUDED
+
+#include "config.h"
+#include <cassert>
+
+/*
+    The 8 symmetries of the board. Symmetry s maps square idx of the
+    transformed board to the square of the original board it is read from:
+    s >= 4 transposes, then bit 0 of (s & 3) flips vertically and bit 1
+    mirrors horizontally. Square indices are y * BOARD_SIZE + x.
+*/
+namespace Symmetry {
+    constexpr int NUM_SYMMETRIES = 8;
+
+    constexpr int compute_index(int vertex, int symmetry) {
+        int x = vertex % BOARD_SIZE;
+        int y = vertex / BOARD_SIZE;
+        if (symmetry >= 4) {
+            const int tmp = x;
+            x = y;
+            y = tmp;
+            symmetry -= 4;
+        }
+        if (symmetry & 1) {
+            y = BOARD_SIZE - y - 1;
+        }
+        if (symmetry & 2) {
+            x = BOARD_SIZE - x - 1;
+        }
+        return y * BOARD_SIZE + x;
+    }
+
+    class Table {
+    public:
+        constexpr Table() : m_table{} {
+            for (int s = 0; s < NUM_SYMMETRIES; s++) {
+                for (int idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+                    m_table[s][idx] = compute_index(idx, s);
+                }
+            }
+        }
+        constexpr int operator()(int symmetry, int idx) const {
+            return m_table[symmetry][idx];
+        }
+    private:
+        int m_table[NUM_SYMMETRIES][BOARD_SQUARE_SIZE];
+    };
+
+    constexpr Table table{};
+
+    inline int transform_index(int idx, int symmetry) {
+        assert(idx >= 0 && idx < BOARD_SQUARE_SIZE);
+        assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
+        return table(symmetry, idx);
+    }
+
+    // Bitboard versions for an 8x8 board, rows are the bytes of the mask
+    inline uint64 flip_vertical(uint64 x) {
+        constexpr uint64 k1 = 0x00FF00FF00FF00FFULL;
+        constexpr uint64 k2 = 0x0000FFFF0000FFFFULL;
+        x = ((x >>  8) & k1) | ((x & k1) <<  8);
+        x = ((x >> 16) & k2) | ((x & k2) << 16);
+        x = ( x >> 32)       | ( x       << 32);
+        return x;
+    }
+
+    inline uint64 mirror_horizontal(uint64 x) {
+        constexpr uint64 k1 = 0x5555555555555555ULL;
+        constexpr uint64 k2 = 0x3333333333333333ULL;
+        constexpr uint64 k4 = 0x0F0F0F0F0F0F0F0FULL;
+        x = ((x >> 1) & k1) | ((x & k1) << 1);
+        x = ((x >> 2) & k2) | ((x & k2) << 2);
+        x = ((x >> 4) & k4) | ((x & k4) << 4);
+        return x;
+    }
+
+    inline uint64 transpose(uint64 x) {
+        constexpr uint64 k1 = 0x5500550055005500ULL;
+        constexpr uint64 k2 = 0x3333000033330000ULL;
+        constexpr uint64 k4 = 0x0F0F0F0F00000000ULL;
+        uint64 t;
+        t  = k4 & (x ^ (x << 28));
+        x ^= t ^ (t >> 28);
+        t  = k2 & (x ^ (x << 14));
+        x ^= t ^ (t >> 14);
+        t  = k1 & (x ^ (x <<  7));
+        x ^= t ^ (t >>  7);
+        return x;
+    }
+
+    // Bit idx of the result is bit transform_index(idx, symmetry) of mask
+    inline uint64 transform_mask(uint64 mask, int symmetry) {
+        static_assert(BOARD_SQUARE_SIZE <= 64,
+                      "a board must fit in a 64-bit mask");
+        assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
+        if (BOARD_SIZE != 8) {
+            auto result = uint64{0};
+            for (int idx = 0; idx < BOARD_SQUARE_SIZE; idx++) {
+                auto bit = (mask >> table(symmetry, idx)) & 1;
+                result |= bit << idx;
+            }
+            return result;
+        }
+        if (symmetry & 1) {
+            mask = flip_vertical(mask);
+        }
+        if (symmetry & 2) {
+            mask = mirror_horizontal(mask);
+        }
+        if (symmetry >= 4) {
+            mask = transpose(mask);
+        }
+        return mask;
+    }
+}
+
+#endif
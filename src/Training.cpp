@@ -98,7 +98,7 @@ void Training::record(GameState& state, UCTNode& root) {
 
 	//得到价值网络估值
     auto result =
-        Network::get_scored_moves(&state, Network::Ensemble::DIRECT, 0);
+        Network::get_Network().get_scored_moves(&state, Network::Ensemble::RANDOM_ROTATION);
     step.net_winrate = result.second;
 
     const auto best_node = root.get_best_root_child(step.to_move);
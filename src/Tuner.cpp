@@ -0,0 +1,443 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#ifdef USE_TUNER
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <boost/algorithm/string.hpp>
+
+#include "Tuner.h"
+#include "Utils.h"
+#include "Winograd.h"
+#include "half/half.hpp"
+
+using namespace Utils;
+
+static const auto TUNER_FILE = std::string{"yuki_opencl_tuning"};
+// Bump when the kernels or the tuned parameters change
+static constexpr auto TUNER_VERSION = 2;
+static constexpr auto TUNER_ITERATIONS = 4;
+
+// How the parameters are written in the tuning file
+static const std::vector<std::pair<std::string, int Tuners::*>> s_parameters = {
+    {"WINOGRAD_TS", &Tuners::winograd_ts},
+    {"WINOGRAD_VW", &Tuners::winograd_vw},
+    {"ROW_TILE_SIZE", &Tuners::row_tile_size},
+    {"CHANNEL_GROUP", &Tuners::channel_group},
+    {"OUTPUT_GROUP", &Tuners::output_group},
+};
+
+static std::string tuners_to_string(const Tuners& tuners) {
+    auto ss = std::ostringstream{};
+    for (const auto& param : s_parameters) {
+        ss << param.first << "=" << tuners.*param.second << " ";
+    }
+    return boost::algorithm::trim_copy(ss.str());
+}
+
+static bool tuners_from_string(const std::string& str, Tuners& tuners) {
+    auto ss = std::istringstream{str};
+    auto item = std::string{};
+    auto found = size_t{0};
+    while (ss >> item) {
+        auto eq = item.find('=');
+        if (eq == std::string::npos) {
+            return false;
+        }
+        auto name = item.substr(0, eq);
+        for (const auto& param : s_parameters) {
+            if (param.first == name) {
+                tuners.*param.second = std::atoi(item.c_str() + eq + 1);
+                found++;
+            }
+        }
+    }
+    return found == s_parameters.size();
+}
+
+static std::vector<float> random_vector(size_t size, std::mt19937& rng) {
+    auto dist = std::uniform_real_distribution<float>{-1.0f, 1.0f};
+    auto vec = std::vector<float>(size);
+    for (auto& val : vec) {
+        val = dist(rng);
+    }
+    return vec;
+}
+
+// Filters in the format the kernels read. With half filters the host
+// copy is rounded too, so the reference sees the same values.
+static cl::Buffer make_filter_buffer(cl::Context& context,
+                                     std::vector<float>& weights) {
+    if (!cfg_half_weights) {
+        return cl::Buffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                          weights.size() * sizeof(float), weights.data());
+    }
+    auto half_weights = std::vector<half_float::half>(weights.size());
+    for (auto i = size_t{0}; i < weights.size(); i++) {
+        half_weights[i] = half_float::half(weights[i]);
+        weights[i] = half_weights[i];
+    }
+    return cl::Buffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                      half_weights.size() * sizeof(half_float::half),
+                      half_weights.data());
+}
+
+static bool compare_results(const std::vector<float>& data,
+                            const std::vector<float>& ref) {
+    constexpr auto max_error = 1e-3f;
+    for (auto i = size_t{0}; i < data.size(); i++) {
+        auto err = std::fabs(data[i] - ref[i]);
+        if (err > max_error * std::max(1.0f, std::fabs(ref[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the kernel and returns its time in nanoseconds
+static cl_ulong run_kernel(cl::CommandQueue& queue, cl::Kernel& kernel,
+                           const cl::NDRange& global,
+                           const cl::NDRange& local) {
+    cl::Event event;
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local,
+                               nullptr, &event);
+    queue.finish();
+    return event.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+           - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+static int round_up(int val, int multiple) {
+    return ((val + multiple - 1) / multiple) * multiple;
+}
+
+// M[b] = U[b] x V[b] of a tower layer, b over the Winograd tile
+class SgemmTest {
+public:
+    SgemmTest(cl::Context& context, int channels, int batch_size)
+        : m_K(channels), m_C(channels), m_T(batch_size * WINOGRAD_P) {
+        auto rng = std::mt19937{0};
+        m_U = random_vector(WINOGRAD_TILE * m_K * m_C, rng);
+        auto V = random_vector(WINOGRAD_TILE * m_C * m_T, rng);
+        m_bufferU = make_filter_buffer(context, m_U);
+        m_bufferV = cl::Buffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                               V.size() * sizeof(float), V.data());
+        m_bufferM = cl::Buffer(context, CL_MEM_WRITE_ONLY,
+                               WINOGRAD_TILE * m_K * m_T * sizeof(float));
+
+        m_ref.resize(WINOGRAD_TILE * m_K * m_T);
+        for (auto b = 0; b < WINOGRAD_TILE; b++) {
+            for (auto k = 0; k < m_K; k++) {
+                for (auto t = 0; t < m_T; t++) {
+                    auto sum = 0.0;
+                    for (auto c = 0; c < m_C; c++) {
+                        sum += m_U[(b * m_K + k) * m_C + c]
+                               * V[(b * m_C + c) * m_T + t];
+                    }
+                    m_ref[(b * m_K + k) * m_T + t] = sum;
+                }
+            }
+        }
+    }
+
+    float time(cl::CommandQueue& queue, cl::Program& program,
+               const Tuners& tuners) {
+        auto kernel = cl::Kernel(program, "winograd_sgemm");
+        kernel.setArg(0, m_bufferU);
+        kernel.setArg(1, m_bufferV);
+        kernel.setArg(2, m_bufferM);
+        kernel.setArg(3, m_K);
+        kernel.setArg(4, m_C);
+        kernel.setArg(5, m_T);
+        const auto ts = tuners.winograd_ts;
+        const auto vw = tuners.winograd_vw;
+        auto global = cl::NDRange(round_up(m_T, ts) / vw, round_up(m_K, ts),
+                                  WINOGRAD_TILE);
+        auto local = cl::NDRange(ts / vw, ts, 1);
+
+        run_kernel(queue, kernel, global, local);
+        auto M = std::vector<float>(m_ref.size());
+        queue.enqueueReadBuffer(m_bufferM, CL_TRUE, 0,
+                                M.size() * sizeof(float), M.data());
+        if (!compare_results(M, m_ref)) {
+            return -1.0f;
+        }
+        auto total = cl_ulong{0};
+        for (auto i = 0; i < TUNER_ITERATIONS; i++) {
+            total += run_kernel(queue, kernel, global, local);
+        }
+        return total / (1000.0f * TUNER_ITERATIONS);
+    }
+
+private:
+    int m_K, m_C, m_T;
+    std::vector<float> m_U;
+    std::vector<float> m_ref;
+    cl::Buffer m_bufferU, m_bufferV, m_bufferM;
+};
+
+// Direct 3x3 convolution of a tower layer
+class ConvolveTest {
+public:
+    ConvolveTest(cl::Context& context, int channels, int batch_size)
+        : m_channels(channels), m_batch_size(batch_size) {
+        constexpr auto W = BOARD_SIZE;
+        constexpr auto H = BOARD_SIZE;
+        const auto spatial = batch_size * BOARD_SQUARE_SIZE;
+        auto rng = std::mt19937{0};
+        auto input = random_vector(channels * spatial, rng);
+        m_weights = random_vector(channels * channels * 9, rng);
+        auto biases = random_vector(channels, rng);
+        m_bufferInput = cl::Buffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                                   input.size() * sizeof(float), input.data());
+        m_bufferWeights = make_filter_buffer(context, m_weights);
+        m_bufferBiases = cl::Buffer(context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                                    biases.size() * sizeof(float), biases.data());
+        m_bufferOutput = cl::Buffer(context, CL_MEM_WRITE_ONLY,
+                                    channels * spatial * sizeof(float));
+
+        m_ref.resize(channels * spatial);
+        for (auto o = 0; o < channels; o++) {
+            for (auto n = 0; n < batch_size; n++) {
+                for (auto y = 0; y < H; y++) {
+                    for (auto x = 0; x < W; x++) {
+                        auto sum = double{biases[o]};
+                        for (auto c = 0; c < channels; c++) {
+                            auto filter = &m_weights[(o * channels + c) * 9];
+                            auto plane = &input[(c * batch_size + n) * W * H];
+                            for (auto ky = 0; ky < 3; ky++) {
+                                for (auto kx = 0; kx < 3; kx++) {
+                                    auto yy = y + ky - 1;
+                                    auto xx = x + kx - 1;
+                                    if ((unsigned)yy < H && (unsigned)xx < W) {
+                                        sum += filter[ky * 3 + kx]
+                                               * plane[yy * W + xx];
+                                    }
+                                }
+                            }
+                        }
+                        m_ref[((o * batch_size + n) * H + y) * W + x] =
+                            std::max(sum, 0.0);
+                    }
+                }
+            }
+        }
+    }
+
+    // Floats of local memory the kernel uses
+    static size_t get_local_size(const Tuners& tuners) {
+        return (tuners.row_tile_size + 2) * (BOARD_SIZE + 2)
+               * tuners.channel_group;
+    }
+
+    float time(cl::CommandQueue& queue, cl::Program& program,
+               const Tuners& tuners) {
+        const auto row_tiles =
+            (BOARD_SIZE + tuners.row_tile_size - 1) / tuners.row_tile_size;
+
+        auto convolve = cl::Kernel(program, "convolve3");
+        convolve.setArg(0, m_bufferInput);
+        convolve.setArg(1, m_bufferOutput);
+        convolve.setArg(2, m_bufferWeights);
+        convolve.setArg(3, m_bufferBiases);
+        convolve.setArg(4, nullptr);
+        convolve.setArg(5, cl::Local(get_local_size(tuners) * sizeof(float)));
+        convolve.setArg(6, m_channels);
+        convolve.setArg(7, tuners.channel_group);
+
+        auto run = [&]() {
+            return run_kernel(queue, convolve,
+                              cl::NDRange(m_channels, row_tiles * m_batch_size),
+                              cl::NDRange(tuners.output_group, 1));
+        };
+
+        run();
+        auto output = std::vector<float>(m_ref.size());
+        queue.enqueueReadBuffer(m_bufferOutput, CL_TRUE, 0,
+                                output.size() * sizeof(float), output.data());
+        if (!compare_results(output, m_ref)) {
+            return -1.0f;
+        }
+        auto total = cl_ulong{0};
+        for (auto i = 0; i < TUNER_ITERATIONS; i++) {
+            total += run();
+        }
+        return total / (1000.0f * TUNER_ITERATIONS);
+    }
+
+private:
+    int m_channels;
+    int m_batch_size;
+    std::vector<float> m_weights;
+    std::vector<float> m_ref;
+    cl::Buffer m_bufferInput, m_bufferWeights, m_bufferBiases;
+    cl::Buffer m_bufferOutput;
+};
+
+std::string Tuner::get_key(int channels, int batch_size) {
+    // The tuning file is separated by ';'
+    auto clean = [](std::string str) {
+        boost::algorithm::trim(str);
+        std::replace(begin(str), end(str), ';', ' ');
+        return str;
+    };
+    auto ss = std::ostringstream{};
+    ss << TUNER_VERSION << ";"
+       << clean(m_device.getInfo<CL_DEVICE_NAME>()) << ";"
+       << clean(m_device.getInfo<CL_DRIVER_VERSION>()) << ";"
+       << BOARD_SIZE << "x" << BOARD_SIZE << ";"
+       << channels << ";" << batch_size << ";"
+       << (cfg_half_weights ? "half" : "float");
+    return ss.str();
+}
+
+void Tuner::save_tuners(const std::string& key, const Tuners& tuners) {
+    auto file = std::ofstream{TUNER_FILE, std::ios::app};
+    if (!file) {
+        myprintf("Could not save the tuning to %s\n", TUNER_FILE.c_str());
+        return;
+    }
+    file << key << ";" << tuners_to_string(tuners) << std::endl;
+}
+
+Tuners Tuner::load_tuners(int channels, int batch_size,
+                          const Tuners& defaults) {
+    auto key = get_key(channels, batch_size);
+    auto file = std::ifstream{TUNER_FILE};
+    auto line = std::string{};
+    // Later lines win, so re-tuning overrides
+    auto loaded = false;
+    auto tuners = defaults;
+    while (std::getline(file, line)) {
+        auto sep = line.rfind(';');
+        if (sep != std::string::npos && line.substr(0, sep) == key) {
+            loaded = tuners_from_string(line.substr(sep + 1), tuners);
+        }
+    }
+    if (loaded) {
+        myprintf("Loaded OpenCL tuning: %s\n", tuners_to_string(tuners).c_str());
+        return tuners;
+    }
+
+    myprintf("Tuning the OpenCL kernels for this device...\n");
+    tuners = tune(channels, batch_size, defaults);
+    myprintf("Best OpenCL tuning: %s\n", tuners_to_string(tuners).c_str());
+    save_tuners(key, tuners);
+    return tuners;
+}
+
+Tuners Tuner::tune(int channels, int batch_size, const Tuners& defaults) {
+    auto queue = cl::CommandQueue(m_context, m_device,
+                                  CL_QUEUE_PROFILING_ENABLE);
+    const auto max_workgroup = m_opencl.get_max_workgroup_size();
+    const auto local_mem = m_device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    auto best = defaults;
+
+    // Times one configuration, a negative time means it failed
+    auto try_tuners = [&](const Tuners& tuners, cl::Program& program,
+                          auto& test) {
+        auto time = -1.0f;
+        try {
+            time = test.time(queue, program, tuners);
+        } catch (const cl::Error&) {
+            // Not supported by this device
+        }
+        if (time < 0.0f) {
+            myprintf("%s failed\n", tuners_to_string(tuners).c_str());
+        } else {
+            myprintf("%s %10.1f us\n", tuners_to_string(tuners).c_str(), time);
+        }
+        return time;
+    };
+    auto build = [&](const Tuners& tuners, cl::Program& program) {
+        try {
+            program = m_opencl.build_program(tuners);
+            return true;
+        } catch (const cl::Error&) {
+            return false;
+        }
+    };
+
+    // Winograd sgemm: tile edge and tiles per work item
+    auto sgemm = SgemmTest(m_context, channels, batch_size);
+    auto best_time = std::numeric_limits<float>::max();
+    auto sgemm_best = best;
+    for (auto ts : {4, 8, 16, 32}) {
+        for (auto vw : {1, 2, 4}) {
+            if (vw > ts || size_t(ts / vw * ts) > max_workgroup
+                || 2 * ts * ts * sizeof(float) > local_mem) {
+                continue;
+            }
+            auto tuners = best;
+            tuners.winograd_ts = ts;
+            tuners.winograd_vw = vw;
+            auto program = cl::Program{};
+            if (!build(tuners, program)) {
+                continue;
+            }
+            auto time = try_tuners(tuners, program, sgemm);
+            if (time >= 0.0f && time < best_time) {
+                best_time = time;
+                sgemm_best = tuners;
+            }
+        }
+    }
+    best = sgemm_best;
+
+    // Direct convolution: rows per work item, input channels copied
+    // locally at a time and outputs per work group
+    auto convolve = ConvolveTest(m_context, channels, batch_size);
+    best_time = std::numeric_limits<float>::max();
+    auto convolve_best = best;
+    for (auto row_tile_size : {1, 2, 4, 8}) {
+        auto tuners = best;
+        tuners.row_tile_size = row_tile_size;
+        auto program = cl::Program{};
+        if (!build(tuners, program)) {
+            continue;
+        }
+        for (auto cg : {4, 8, 16, 32}) {
+            for (auto og : {8, 16, 32, 64}) {
+                tuners.channel_group = cg;
+                tuners.output_group = og;
+                const auto local_size =
+                    ConvolveTest::get_local_size(tuners) * sizeof(float);
+                if (channels % cg != 0 || channels % og != 0
+                    || size_t(og) > max_workgroup
+                    || local_size > local_mem) {
+                    continue;
+                }
+                auto time = try_tuners(tuners, program, convolve);
+                if (time >= 0.0f && time < best_time) {
+                    best_time = time;
+                    convolve_best = tuners;
+                }
+            }
+        }
+    }
+    best = convolve_best;
+
+    return best;
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TUNER_H_INCLUDED
+#define TUNER_H_INCLUDED
+
+#include "config.h"
+#include <string>
+#include <vector>
+
+#include "OpenCL.h"
+
+/*
+    Picks the work group and tile sizes of the convolution kernels for
+    the device. Every candidate is built, checked against a host
+    reference and timed, and the fastest one is stored in the tuning
+    file, so the next start with the same device, driver and network
+    shape loads it without tuning again.
+*/
+class Tuner {
+public:
+    Tuner(OpenCL & opencl, cl::Context & context, cl::Device & device) :
+        m_opencl(opencl), m_context(context), m_device(device) {}
+
+    // defaults is used for anything that cannot be tuned
+    Tuners load_tuners(int channels, int batch_size, const Tuners& defaults);
+
+private:
+    Tuners tune(int channels, int batch_size, const Tuners& defaults);
+    std::string get_key(int channels, int batch_size);
+    void save_tuners(const std::string& key, const Tuners& tuners);
+
+    OpenCL & m_opencl;
+    cl::Context & m_context;
+    cl::Device & m_device;
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "zlib.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Weights.h"
+#include "Network.h"
+#include "Utils.h"
+#include "half/half.hpp"
+
+using namespace Utils;
+
+namespace {
+
+// Read-only view of a whole file, mapped where mmap exists
+class FileView {
+public:
+    explicit FileView(const std::string& filename);
+    ~FileView();
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+
+    const unsigned char * data() const {
+        return m_data;
+    }
+    size_t size() const {
+        return m_size;
+    }
+    bool ok() const {
+        return m_data != nullptr;
+    }
+
+private:
+    const unsigned char * m_data{nullptr};
+    size_t m_size{0};
+#ifdef _WIN32
+    std::vector<unsigned char> m_buffer;
+#endif
+};
+
+#ifndef _WIN32
+FileView::FileView(const std::string& filename) {
+    const auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            m_data = static_cast<const unsigned char*>(addr);
+            m_size = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+FileView::~FileView() {
+    if (m_data) {
+        munmap(const_cast<unsigned char*>(m_data), m_size);
+    }
+}
+#else
+FileView::FileView(const std::string& filename) {
+    auto file = std::ifstream{filename, std::ios::binary};
+    if (!file) {
+        return;
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>{file},
+                    std::istreambuf_iterator<char>{});
+    if (!m_buffer.empty()) {
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+    }
+}
+
+FileView::~FileView() {}
+#endif
+
+}
+
+static bool load_text(const std::string& filename, Weights::Tensors& tensors) {
+    auto wtfile = std::ifstream{filename};
+    if (!wtfile) {
+        myprintf("Could not open weights file: %s\n", filename.c_str());
+        return false;
+    }
+    // First line is the file format version id
+    auto line = std::string{};
+    std::getline(wtfile, line);
+    auto format_version = std::atoi(line.c_str());
+    if (format_version != Network::FORMAT_VERSION) {
+        myprintf("Weights file is the wrong version.\n");
+        return false;
+    }
+    myprintf("v%d...", format_version);
+
+    while (std::getline(wtfile, line)) {
+        auto weights = std::vector<float>{};
+        auto ptr = line.c_str();
+        char * end;
+        for (auto weight = std::strtof(ptr, &end); end != ptr;
+             weight = std::strtof(ptr, &end)) {
+            weights.emplace_back(weight);
+            ptr = end;
+        }
+        tensors.emplace_back(std::move(weights));
+    }
+    return true;
+}
+
+static bool load_binary(const FileView& view, Weights::Tensors& tensors) {
+    using namespace Weights;
+
+    auto header = Header{};
+    std::memcpy(&header, view.data(), sizeof(header));
+    if (header.version != BINARY_VERSION) {
+        myprintf("Binary weights file is version %d, expected %d.\n",
+                 header.version, BINARY_VERSION);
+        return false;
+    }
+    if (header.data_type != FP32 && header.data_type != FP16) {
+        myprintf("Unknown data type %d in the weights file.\n",
+                 header.data_type);
+        return false;
+    }
+    // Input convolution, 2 convolutions per residual block, 4 tensors
+    // each, and the 14 tensors of the heads
+    if (header.tensor_count != 4 * (1 + 2 * header.residual_blocks) + 14) {
+        myprintf("Weights file has %d tensors, expected %d for %d blocks.\n",
+                 header.tensor_count, 4 * (1 + 2 * header.residual_blocks) + 14,
+                 header.residual_blocks);
+        return false;
+    }
+    const auto table_size = sizeof(Section) * header.tensor_count;
+    if (view.size() < sizeof(Header) + table_size) {
+        myprintf("Weights file is truncated.\n");
+        return false;
+    }
+    const auto checksum = crc32(crc32(0L, Z_NULL, 0),
+                                view.data() + sizeof(Header),
+                                view.size() - sizeof(Header));
+    if (checksum != header.checksum) {
+        myprintf("Weights file checksum mismatch, the file is corrupt.\n");
+        return false;
+    }
+    myprintf("binary v%d %s...", header.version,
+             header.data_type == FP16 ? "fp16" : "fp32");
+
+    const auto value_size = header.data_type == FP16 ? 2 : 4;
+    tensors.reserve(header.tensor_count);
+    for (auto i = size_t{0}; i < header.tensor_count; i++) {
+        auto section = Section{};
+        std::memcpy(&section,
+                    view.data() + sizeof(Header) + i * sizeof(Section),
+                    sizeof(section));
+        if (section.offset % SECTION_ALIGNMENT != 0
+            || section.offset > view.size()
+            || section.count > (view.size() - section.offset) / value_size) {
+            myprintf("Tensor %d is outside the weights file.\n", i);
+            return false;
+        }
+        const auto src = view.data() + section.offset;
+        auto weights = std::vector<float>(section.count);
+        if (header.data_type == FP32) {
+            std::memcpy(weights.data(), src, section.count * sizeof(float));
+        } else {
+            for (auto j = size_t{0}; j < section.count; j++) {
+                half_float::half value;
+                std::memcpy(&value, src + j * sizeof(value), sizeof(value));
+                weights[j] = value;
+            }
+        }
+        tensors.emplace_back(std::move(weights));
+    }
+    return true;
+}
+
+bool Weights::load(const std::string& filename, Tensors& tensors) {
+    tensors.clear();
+    {
+        const FileView view{filename};
+        if (!view.ok()) {
+            myprintf("Could not open weights file: %s\n", filename.c_str());
+            return false;
+        }
+        if (view.size() >= sizeof(Header)
+            && std::memcmp(view.data(), MAGIC, sizeof(MAGIC)) == 0) {
+            return load_binary(view, tensors);
+        }
+    }
+    return load_text(filename, tensors);
+}
@@ -0,0 +1,78 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WEIGHTS_H_INCLUDED
+#define WEIGHTS_H_INCLUDED
+
+#include "config.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+    Reads the network weights, either the text format written by
+    save_leelaz_weights or the binary format of train/convert_weights.py.
+
+    The binary file (little endian) is a Header, a table of tensor_count
+    Sections and the tensors, each one starting on a SECTION_ALIGNMENT
+    boundary. The tensors are the lines of the text file in the same
+    order, stored as fp32 or fp16. The file is mapped into memory and
+    the tensors are copied out without any parsing.
+*/
+namespace Weights {
+    // Every tensor of the file in order, without the version line
+    using Tensors = std::vector<std::vector<float>>;
+
+    constexpr char MAGIC[8] = {'Y', 'U', 'K', 'I', 'W', 'T', 'S', '\0'};
+    // Bump when the layout of the binary file changes
+    constexpr std::uint32_t BINARY_VERSION = 1;
+    constexpr std::uint64_t SECTION_ALIGNMENT = 64;
+
+    enum DataType : std::uint32_t {
+        FP32 = 0, FP16 = 1
+    };
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t data_type;
+        std::uint32_t residual_blocks;
+        std::uint32_t channels;
+        std::uint32_t tensor_count;
+        // zlib CRC-32 of everything after the header
+        std::uint32_t checksum;
+        std::uint8_t reserved[32];
+    };
+    static_assert(sizeof(Header) == 64, "Header must be 64 bytes");
+
+    struct Section {
+        // From the start of the file
+        std::uint64_t offset;
+        // Number of values, not bytes
+        std::uint64_t count;
+    };
+    static_assert(sizeof(Section) == 16, "Section must be 16 bytes");
+
+    /*
+        fill tensors from the file, the format is detected from the
+        first bytes. Prints the reason and returns false on failure.
+    */
+    bool load(const std::string& filename, Tensors& tensors);
+}
+
+#endif
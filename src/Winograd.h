@@ -0,0 +1,211 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WINOGRAD_H_INCLUDED
+#define WINOGRAD_H_INCLUDED
+
+#include "config.h"
+#include <vector>
+#include <cassert>
+
+#include "Workspace.h"
+
+// Winograd F(4x4, 3x3): every 4x4 output tile is computed from a 6x6
+// input tile, and an 8x8 board splits exactly into 2x2 such tiles.
+constexpr int WINOGRAD_M = 4;
+constexpr int WINOGRAD_ALPHA = WINOGRAD_M + 3 - 1;
+constexpr int WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+constexpr int WINOGRAD_WTILES = BOARD_SIZE / WINOGRAD_M;
+constexpr int WINOGRAD_P = WINOGRAD_WTILES * WINOGRAD_WTILES;
+
+static_assert(BOARD_SIZE % WINOGRAD_M == 0,
+              "Winograd tiles must cover the board exactly");
+
+// Filter transform U = G g G^T.
+// f is [outputs][channels][3][3], U is [WINOGRAD_TILE][outputs][channels]
+inline std::vector<float> winograd_transform_f(const std::vector<float>& f,
+                                               int outputs, int channels) {
+    constexpr float G[WINOGRAD_ALPHA][3] = {
+        { 1.0f/4.0f,   0.0f,        0.0f      },
+        {-1.0f/6.0f,  -1.0f/6.0f,  -1.0f/6.0f },
+        {-1.0f/6.0f,   1.0f/6.0f,  -1.0f/6.0f },
+        { 1.0f/24.0f,  1.0f/12.0f,  1.0f/6.0f },
+        { 1.0f/24.0f, -1.0f/12.0f,  1.0f/6.0f },
+        { 0.0f,        0.0f,        1.0f      }
+    };
+    assert(f.size() == size_t(outputs * channels * 9));
+
+    auto U = std::vector<float>(WINOGRAD_TILE * outputs * channels);
+    float temp[WINOGRAD_ALPHA][3];
+
+    for (int o = 0; o < outputs; o++) {
+        for (int c = 0; c < channels; c++) {
+            const float * g = &f[(o * channels + c) * 9];
+            // temp = G g
+            for (int i = 0; i < WINOGRAD_ALPHA; i++) {
+                for (int j = 0; j < 3; j++) {
+                    temp[i][j] = G[i][0] * g[0 * 3 + j]
+                               + G[i][1] * g[1 * 3 + j]
+                               + G[i][2] * g[2 * 3 + j];
+                }
+            }
+            // U = temp G^T
+            for (int xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                for (int nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                    auto val = temp[xi][0] * G[nu][0]
+                             + temp[xi][1] * G[nu][1]
+                             + temp[xi][2] * G[nu][2];
+                    U[((xi * WINOGRAD_ALPHA + nu) * outputs + o) * channels + c] = val;
+                }
+            }
+        }
+    }
+
+    return U;
+}
+
+// y = B^T x for one line of an input tile
+inline void winograd_multiply_bt(const float * x, float * y, int stride) {
+    y[0 * stride] = 4.0f * x[0 * stride] - 5.0f * x[2 * stride] + x[4 * stride];
+    y[1 * stride] = -4.0f * x[1 * stride] - 4.0f * x[2 * stride]
+                    + x[3 * stride] + x[4 * stride];
+    y[2 * stride] = 4.0f * x[1 * stride] - 4.0f * x[2 * stride]
+                    - x[3 * stride] + x[4 * stride];
+    y[3 * stride] = -2.0f * x[1 * stride] - x[2 * stride]
+                    + 2.0f * x[3 * stride] + x[4 * stride];
+    y[4 * stride] = 2.0f * x[1 * stride] - x[2 * stride]
+                    - 2.0f * x[3 * stride] + x[4 * stride];
+    y[5 * stride] = 4.0f * x[1 * stride] - 5.0f * x[3 * stride] + x[5 * stride];
+}
+
+// y = A^T x for one line of an output tile
+inline void winograd_multiply_at(const float * x, float * y, int stride) {
+    y[0 * stride] = x[0 * stride] + x[1 * stride] + x[2 * stride]
+                    + x[3 * stride] + x[4 * stride];
+    y[1 * stride] = x[1 * stride] - x[2 * stride]
+                    + 2.0f * x[3 * stride] - 2.0f * x[4 * stride];
+    y[2 * stride] = x[1 * stride] + x[2 * stride]
+                    + 4.0f * x[3 * stride] + 4.0f * x[4 * stride];
+    y[3 * stride] = x[1 * stride] - x[2 * stride]
+                    + 8.0f * x[3 * stride] - 8.0f * x[4 * stride] + x[5 * stride];
+}
+
+// Input transform V = B^T d B.
+// in is [channels][batch_size][BOARD_SQUARE_SIZE],
+// V is [WINOGRAD_TILE][channels][batch_size * WINOGRAD_P]
+inline void winograd_transform_in(const aligned_vector& in,
+                                  aligned_vector& V,
+                                  int channels, int batch_size) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    const int tiles = batch_size * WINOGRAD_P;
+
+    float d[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+    float t1[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+    float v[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+
+    for (int c = 0; c < channels; c++) {
+        for (int n = 0; n < batch_size; n++) {
+            const float * plane = &in[(c * batch_size + n) * W * H];
+            for (int tile = 0; tile < WINOGRAD_P; tile++) {
+                const int y0 = (tile / WINOGRAD_WTILES) * WINOGRAD_M - 1;
+                const int x0 = (tile % WINOGRAD_WTILES) * WINOGRAD_M - 1;
+                // Gather the 6x6 tile, zero padded at the edges
+                for (int i = 0; i < WINOGRAD_ALPHA; i++) {
+                    for (int j = 0; j < WINOGRAD_ALPHA; j++) {
+                        const int y = y0 + i;
+                        const int x = x0 + j;
+                        if ((unsigned)y < H && (unsigned)x < W) {
+                            d[i][j] = plane[y * W + x];
+                        } else {
+                            d[i][j] = 0.0f;
+                        }
+                    }
+                }
+                for (int j = 0; j < WINOGRAD_ALPHA; j++) {
+                    winograd_multiply_bt(&d[0][j], &t1[0][j], WINOGRAD_ALPHA);
+                }
+                for (int i = 0; i < WINOGRAD_ALPHA; i++) {
+                    winograd_multiply_bt(&t1[i][0], &v[i][0], 1);
+                }
+                const int t = n * WINOGRAD_P + tile;
+                for (int xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                    for (int nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                        V[((xi * WINOGRAD_ALPHA + nu) * channels + c) * tiles + t] =
+                            v[xi][nu];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Output transform Y = A^T m A, plus the convolution bias, the optional
+// residual eltwise and ReLU.
+// M is [WINOGRAD_TILE][outputs][batch_size * WINOGRAD_P],
+// out and eltwise are [outputs][batch_size][BOARD_SQUARE_SIZE]
+inline void winograd_transform_out(const aligned_vector& M,
+                                   const std::vector<float>& biases,
+                                   const float * eltwise,
+                                   aligned_vector& out,
+                                   int outputs, int batch_size) {
+    constexpr int W = BOARD_SIZE;
+    constexpr int H = BOARD_SIZE;
+    const int tiles = batch_size * WINOGRAD_P;
+
+    float m[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+    float t1[WINOGRAD_M][WINOGRAD_ALPHA];
+    float y[WINOGRAD_M][WINOGRAD_M];
+
+    for (int k = 0; k < outputs; k++) {
+        for (int n = 0; n < batch_size; n++) {
+            const auto offset = (k * batch_size + n) * W * H;
+            float * plane = &out[offset];
+            const float * res = eltwise ? &eltwise[offset] : nullptr;
+            for (int tile = 0; tile < WINOGRAD_P; tile++) {
+                const int t = n * WINOGRAD_P + tile;
+                for (int xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                    for (int nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                        m[xi][nu] =
+                            M[((xi * WINOGRAD_ALPHA + nu) * outputs + k) * tiles + t];
+                    }
+                }
+                for (int j = 0; j < WINOGRAD_ALPHA; j++) {
+                    winograd_multiply_at(&m[0][j], &t1[0][j], WINOGRAD_ALPHA);
+                }
+                for (int i = 0; i < WINOGRAD_M; i++) {
+                    winograd_multiply_at(&t1[i][0], &y[i][0], 1);
+                }
+                const int y0 = (tile / WINOGRAD_WTILES) * WINOGRAD_M;
+                const int x0 = (tile % WINOGRAD_WTILES) * WINOGRAD_M;
+                for (int i = 0; i < WINOGRAD_M; i++) {
+                    for (int j = 0; j < WINOGRAD_M; j++) {
+                        const int idx = (y0 + i) * W + x0 + j;
+                        auto val = y[i][j] + biases[k];
+                        if (res) {
+                            val += res[idx];
+                        }
+                        plane[idx] = val > 0.0f ? val : 0.0f;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
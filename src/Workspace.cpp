@@ -0,0 +1,38 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <atomic>
+
+#include "Workspace.h"
+
+static std::atomic<uint64> s_allocations{0};
+
+uint64 Workspace::get_allocations(void) {
+    return s_allocations.load();
+}
+
+void Workspace::count_allocation(void) {
+    s_allocations++;
+}
+
+Workspace::Buffers& Workspace::get_thread_buffers(void) {
+    static thread_local Buffers s_buffers;
+    return s_buffers;
+}
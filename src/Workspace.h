@@ -0,0 +1,114 @@
+/*
+    This file is part of Yuki.
+    Copyright (C) 2017 Guofeng Dai
+
+    Yuki is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Yuki is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKSPACE_H_INCLUDED
+#define WORKSPACE_H_INCLUDED
+
+#include "config.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace Workspace {
+    // Amount of buffer (re)allocations made by all threads so far
+    uint64 get_allocations(void);
+    void count_allocation(void);
+}
+
+// Allocates cache line aligned memory and counts the allocations,
+// so it can be verified that the forward pass buffers stop growing.
+template <typename T, size_t Alignment = 64>
+class AlignedAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T * allocate(size_t n) {
+        void * ptr = nullptr;
+        if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        Workspace::count_allocation();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T * ptr, size_t) {
+        free(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+        return false;
+    }
+};
+
+using aligned_vector = std::vector<float, AlignedAllocator<float>>;
+using aligned_int8_vector = std::vector<int8_t, AlignedAllocator<int8_t>>;
+using aligned_uint8_vector = std::vector<uint8_t, AlignedAllocator<uint8_t>>;
+using aligned_uint64_vector = std::vector<uint64, AlignedAllocator<uint64>>;
+
+namespace Workspace {
+    /*
+        Scratch buffers for one forward pass. Every thread that evaluates
+        the network gets its own set, which only grows when a larger batch
+        than before comes through.
+    */
+    struct Buffers {
+        // Network input as one bit mask per plane ([batch][planes]),
+        // then expanded to floats
+        aligned_uint64_vector input_masks;
+        aligned_vector input;
+        // Residual tower
+        aligned_vector conv_in;
+        aligned_vector conv_out;
+        aligned_vector res;
+        // Convolution scratch: im2col columns, Winograd V and M
+        aligned_vector col;
+        aligned_vector V;
+        aligned_vector M;
+        // Zero padded input of the direct 3x3 convolutions
+        aligned_vector padded;
+        // Quantized input of the int8 convolutions, one scale per board
+        aligned_uint8_vector qinput;
+        aligned_vector qscales;
+        // Policy and value heads
+        aligned_vector head_data;
+        aligned_vector policy_out;
+        aligned_vector policy;
+        aligned_vector value_fc;
+        aligned_vector winrate;
+    };
+
+    Buffers& get_thread_buffers(void);
+}
+
+#endif
@@ -23,6 +23,8 @@
 
 std::array<std::array<uint64, FastBoard::MAXSQ>,     4> Zobrist::zobrist;
 std::array<uint64, 5>                                   Zobrist::zobrist_pass;
+uint64                                                  Zobrist::zobrist_blacktomove;
+std::array<std::array<std::array<uint64, 256>, 8>, 2>   Zobrist::zobrist_discs;
 
 void Zobrist::init_zobrist(Random & rng) {
     for (int i = 0; i < 4; i++) {
@@ -37,4 +39,23 @@ void Zobrist::init_zobrist(Random & rng) {
         Zobrist::zobrist_pass[i]  = ((uint64)rng.randuint32()) << 32;
         Zobrist::zobrist_pass[i] ^= (uint64)rng.randuint32();
     }
+
+    Zobrist::zobrist_blacktomove  = ((uint64)rng.randuint32()) << 32;
+    Zobrist::zobrist_blacktomove ^= (uint64)rng.randuint32();
+
+    // A row is hashed as the XOR of the keys of its discs, so that
+    // hashing a mask of flipped discs equals flipping them one by one
+    for (int c = 0; c < 2; c++) {
+        for (int row = 0; row < 8; row++) {
+            auto& keys = Zobrist::zobrist_discs[c][row];
+            keys[0] = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                auto key = ((uint64)rng.randuint32()) << 32;
+                key ^= (uint64)rng.randuint32();
+                for (int discs = 0; discs < (1 << bit); discs++) {
+                    keys[discs | (1 << bit)] = keys[discs] ^ key;
+                }
+            }
+        }
+    }
 }
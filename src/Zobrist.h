@@ -27,6 +27,9 @@ class Zobrist {
 public:
     static std::array<std::array<uint64, FastBoard::MAXSQ>,     4> zobrist;
     static std::array<uint64, 5>                                   zobrist_pass;
+    static uint64                                                  zobrist_blacktomove;
+    // Bitboard keys, [color][row][discs of the row], see Bitboard::hash_discs
+    static std::array<std::array<std::array<uint64, 256>, 8>, 2>   zobrist_discs;
 
     static void init_zobrist(Random & rng);
 };
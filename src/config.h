@@ -35,8 +35,29 @@
 #define USE_BLAS
 #define USE_OPENBLAS
 //#define USE_MKL
+/*
+ * USE_OPENCL: Run the residual tower on an OpenCL device. Without it,
+ * the whole network is evaluated with BLAS. The BLAS backend can also be
+ * selected at runtime with cfg_cpu_only.
+ */
 #define USE_OPENCL
-//#define USE_TUNER
+/*
+ * USE_OPENCL_SELFCHECK: Periodically verify the OpenCL results against
+ * the BLAS backend.
+ */
+//#define USE_OPENCL_SELFCHECK
+/*
+ * USE_TUNER: Pick the OpenCL work group and tile sizes by timing them on
+ * the device at the first start, the result is kept in a tuning file.
+ */
+#define USE_TUNER
+
+#if defined(USE_OPENCL_SELFCHECK) && !defined(USE_OPENCL)
+#undef USE_OPENCL_SELFCHECK
+#endif
+#if defined(USE_TUNER) && !defined(USE_OPENCL)
+#undef USE_TUNER
+#endif
 
 #define PROGRAM_NAME "Yuki"
 #define PROGRAM_VERSION "0.1"
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+#
+#    This file is part of Yuki.
+#    Copyright (C) 2017 Guofeng Dai
+#
+#    Yuki is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    Yuki is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with Yuki.  If not, see <http://www.gnu.org/licenses/>.
+
+# Converts the text weights written by save_leelaz_weights into the
+# binary format the engine maps into memory, see src/Weights.h.
+#
+# usage: convert_weights.py input.txt output.bin [--half]
+
+import struct
+import sys
+import zlib
+import numpy as np
+
+MAGIC = b"YUKIWTS\0"
+TEXT_VERSION = 1
+BINARY_VERSION = 1
+SECTION_ALIGNMENT = 64
+FP32, FP16 = 0, 1
+# magic, version, data type, blocks, channels, tensors, checksum, reserved
+HEADER = struct.Struct("<8s6I32x")
+SECTION = struct.Struct("<QQ")
+
+def read_text_weights(filename):
+    with open(filename, "r") as file:
+        version = int(file.readline())
+        if version != TEXT_VERSION:
+            raise ValueError("Weights file is version {}, expected {}".format(
+                version, TEXT_VERSION))
+        return [np.array(line.split(), dtype=np.float32) for line in file]
+
+def align(offset):
+    return (offset + SECTION_ALIGNMENT - 1) // SECTION_ALIGNMENT * SECTION_ALIGNMENT
+
+def write_binary_weights(tensors, filename, half=False):
+    # 1 input layer (4 x weights), 14 ending weights, every residual
+    # block has 8 x weights
+    if len(tensors) < 4 + 14 or (len(tensors) - (4 + 14)) % 8 != 0:
+        raise ValueError("Inconsistent number of weights: {}".format(
+            len(tensors)))
+    blocks = (len(tensors) - (4 + 14)) // 8
+    channels = len(tensors[1])
+    dtype = np.dtype("<f2") if half else np.dtype("<f4")
+
+    sections = []
+    offset = align(HEADER.size + SECTION.size * len(tensors))
+    for tensor in tensors:
+        sections.append((offset, tensor.size))
+        offset = align(offset + tensor.size * dtype.itemsize)
+
+    body = bytearray(offset - HEADER.size)
+    for i, (offset, count) in enumerate(sections):
+        SECTION.pack_into(body, i * SECTION.size, offset, count)
+    for tensor, (offset, count) in zip(tensors, sections):
+        data = tensor.astype(dtype).tobytes()
+        start = offset - HEADER.size
+        body[start:start + len(data)] = data
+
+    checksum = zlib.crc32(body) & 0xffffffff
+    header = HEADER.pack(MAGIC, BINARY_VERSION, FP16 if half else FP32,
+                         blocks, channels, len(tensors), checksum)
+    with open(filename, "wb") as file:
+        file.write(header)
+        file.write(body)
+    return blocks, channels
+
+def main(args):
+    if len(args) < 2:
+        print("usage: convert_weights.py input.txt output.bin [--half]")
+        return 1
+    half = "--half" in args[2:]
+    tensors = read_text_weights(args[0])
+    blocks, channels = write_binary_weights(tensors, args[1], half)
+    print("Wrote {} blocks x {} channels ({}) to {}".format(
+        blocks, channels, "fp16" if half else "fp32", args[1]))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
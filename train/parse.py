@@ -33,6 +33,8 @@ BATCH_SIZE = 256
 def remap_vertex(vertex, symmetry):
     """
         Remap a go board coordinate according to a symmetry.
+
+        Matches Symmetry::compute_index in the engine.
     """
     assert vertex >= 0 and vertex < 64
     x = vertex % 8
@@ -41,11 +43,15 @@ def remap_vertex(vertex, symmetry):
         x, y = y, x
         symmetry -= 4
     if symmetry == 1 or symmetry == 3:
-        x = 8 - x - 1
-    if symmetry == 2 or symmetry == 3:
         y = 8 - y - 1
+    if symmetry == 2 or symmetry == 3:
+        x = 8 - x - 1
     return y * 8 + x
 
+# SYMMETRY_TABLE[symmetry][vertex] = remap_vertex(vertex, symmetry)
+SYMMETRY_TABLE = [[remap_vertex(vertex, symmetry) for vertex in range(64)]
+                  for symmetry in range(8)]
+
 def apply_symmetry(plane, symmetry):
     """
         Applies one of 8 symmetries to the go board.
@@ -54,9 +60,7 @@ def apply_symmetry(plane, symmetry):
         element is pass will which get the identity mapping.
     """
     assert symmetry >= 0 and symmetry < 8
-    work_plane = [0.0] * 64
-    for vertex in range(0, 64):
-        work_plane[vertex] = plane[remap_vertex(vertex, symmetry)]
+    work_plane = [plane[vertex] for vertex in SYMMETRY_TABLE[symmetry]]
     # Map back "pass"
     if len(plane) == 65:
         work_plane.append(plane[64])